@@ -0,0 +1,120 @@
+#pragma once
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+namespace numa {
+
+/// @brief Parse a cpulist of /sys, e.g. "0-3,8-11".
+/// @param list
+/// @return
+[[nodiscard]] inline std::vector<int> parse_cpulist(const std::string &list) {
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string range;
+
+    while (std::getline(ss, range, ',')) {
+        if (range.empty() || range == "\n") continue;
+
+        const auto dash = range.find('-');
+        const int first = std::stoi(range.substr(0, dash));
+        const int last  = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+
+        for (int cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back(cpu);
+        }
+    }
+
+    return cpus;
+}
+
+/// @brief The CPUs of each NUMA node that the process may run on. Without NUMA information, a
+/// single node with all allowed CPUs.
+/// @return
+[[nodiscard]] inline std::vector<std::vector<int>> node_cpus() {
+    std::vector<int> allowed;
+
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set)) allowed.push_back(cpu);
+        }
+    }
+#endif
+
+    std::vector<std::pair<int, std::vector<int>>> nodes;
+    std::error_code ec;
+
+    for (const auto &entry :
+         std::filesystem::directory_iterator("/sys/devices/system/node", ec)) {
+        const auto name = entry.path().filename().string();
+
+        if (name.size() <= 4 || name.compare(0, 4, "node") != 0 ||
+            !std::all_of(name.begin() + 4, name.end(), ::isdigit)) {
+            continue;
+        }
+
+        std::ifstream file(entry.path() / "cpulist");
+        std::string list;
+        std::getline(file, list);
+
+        auto cpus = parse_cpulist(list);
+
+        // only the CPUs this process may run on, e.g. within a cpuset or taskset
+        cpus.erase(std::remove_if(cpus.begin(), cpus.end(),
+                                  [&](int cpu) {
+                                      return std::find(allowed.begin(), allowed.end(), cpu) ==
+                                             allowed.end();
+                                  }),
+                   cpus.end());
+
+        if (!cpus.empty()) {
+            nodes.emplace_back(std::stoi(name.substr(4)), std::move(cpus));
+        }
+    }
+
+    std::sort(nodes.begin(), nodes.end());
+
+    std::vector<std::vector<int>> result;
+
+    for (auto &node : nodes) {
+        result.push_back(std::move(node.second));
+    }
+
+    if (result.empty()) {
+        result.push_back(allowed);
+    }
+
+    return result;
+}
+
+/// @brief Pin the calling thread to the cpu, does nothing for a negative cpu.
+/// @param cpu
+/// @return false if the thread could not be pinned
+inline bool pin(int cpu) {
+#ifdef __linux__
+    if (cpu < 0) return false;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
+}  // namespace numa
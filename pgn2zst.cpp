@@ -0,0 +1,271 @@
+#include <zstd.h>
+
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "external/gzip/gzstream.h"
+#include "external/threadpool.hpp"
+#include "scoreWDLstat.hpp"
+#include "zstdstream.hpp"
+
+namespace fs = std::filesystem;
+
+std::atomic<std::size_t> total_files = 0;
+std::atomic<std::size_t> total_bytes = 0;
+
+/// @brief Writes the frames of a seekable zstd file, starting with the skippable frame that marks
+/// the frames as game aligned and ending with the seek table.
+class SeekableWriter {
+   public:
+    SeekableWriter(std::ostream &out, int level) : out(out), level(level), ctx(ZSTD_createCCtx()) {
+        zstd::write_le32(out, zstd::game_aligned_magic);
+        zstd::write_le32(out, sizeof(zstd::game_aligned_tag));
+        out.write(zstd::game_aligned_tag, sizeof(zstd::game_aligned_tag));
+
+        frames.push_back({std::uint32_t(zstd::game_aligned_size), 0});
+    }
+
+    ~SeekableWriter() { ZSTD_freeCCtx(ctx); }
+
+    SeekableWriter(const SeekableWriter &)            = delete;
+    SeekableWriter &operator=(const SeekableWriter &) = delete;
+
+    bool write_frame(const std::string &data) {
+        buffer.resize(ZSTD_compressBound(data.size()));
+
+        const auto size =
+            ZSTD_compressCCtx(ctx, buffer.data(), buffer.size(), data.data(), data.size(), level);
+
+        if (ZSTD_isError(size)) {
+            std::cerr << "Error while compressing: " << ZSTD_getErrorName(size) << std::endl;
+            return false;
+        }
+
+        out.write(buffer.data(), size);
+        frames.push_back({std::uint32_t(size), std::uint32_t(data.size())});
+
+        return true;
+    }
+
+    void write_seek_table() {
+        zstd::write_le32(out, zstd::skippable_magic);
+        zstd::write_le32(out, frames.size() * 8 + zstd::seek_footer_size);
+
+        for (const auto &[compressed, decompressed] : frames) {
+            zstd::write_le32(out, compressed);
+            zstd::write_le32(out, decompressed);
+        }
+
+        // footer: number of frames, descriptor without checksums, magic number
+        zstd::write_le32(out, frames.size());
+        out.put(0);
+        zstd::write_le32(out, zstd::seekable_magic);
+    }
+
+   private:
+    std::ostream &out;
+    const int level;
+
+    ZSTD_CCtx *ctx;
+    std::vector<char> buffer;
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> frames;
+};
+
+/// @brief Transcode a .pgn(.gz) file into a seekable .pgn.zst file, each frame holding complete
+/// games of about frame_size bytes.
+/// @param file
+/// @param frame_size
+/// @param level
+/// @return the name of the written file, empty on failure
+std::string transcode(const std::string &file, std::size_t frame_size, int level) {
+    const bool gzipped         = file.size() >= 3 && file.substr(file.size() - 3) == ".gz";
+    const std::string basename = gzipped ? file.substr(0, file.size() - 3) : file;
+    const std::string zst_file = basename + ".zst";
+    const std::string tmp_file = zst_file + ".tmp";
+
+    std::unique_ptr<std::istream> input;
+
+    if (gzipped) {
+        auto gz = std::make_unique<igzstream>(file.c_str());
+        if (!gz->rdbuf()->is_open()) gz->setstate(std::ios::failbit);
+        input = std::move(gz);
+    } else {
+        input = std::make_unique<std::ifstream>(file);
+    }
+
+    if (!*input) {
+        std::cerr << "Error: Could not open " << file << std::endl;
+        return {};
+    }
+
+    std::ofstream out(tmp_file, std::ios::binary | std::ios::trunc);
+    SeekableWriter writer(out, level);
+
+    const auto fail = [&]() {
+        std::cerr << "Error: Could not transcode " << file << std::endl;
+        out.close();
+        fs::remove(tmp_file);
+        return std::string();
+    };
+
+    std::string line, frame;
+    bool in_moves = false;
+
+    while (std::getline(*input, line)) {
+        const bool is_header = !line.empty() && line[0] == '[';
+
+        // a header after movetext starts a new game, the only place where a frame may end
+        if (is_header && in_moves) {
+            in_moves = false;
+
+            if (frame.size() >= frame_size) {
+                if (!writer.write_frame(frame)) return fail();
+                total_bytes += frame.size();
+                frame.clear();
+            }
+        } else if (!is_header && !line.empty()) {
+            in_moves = true;
+        }
+
+        frame += line;
+        frame += '\n';
+    }
+
+    if (!frame.empty()) {
+        if (!writer.write_frame(frame)) return fail();
+        total_bytes += frame.size();
+    }
+
+    writer.write_seek_table();
+    out.close();
+
+    if (input->bad() || !out) {
+        return fail();
+    }
+
+    std::error_code ec;
+    fs::rename(tmp_file, zst_file, ec);
+
+    if (ec) {
+        std::cerr << "Error: Could not write " << zst_file << ": " << ec.message() << std::endl;
+        return {};
+    }
+
+    return zst_file;
+}
+
+void print_usage(char const *program_name) {
+    std::stringstream ss;
+
+    // clang-format off
+    ss << "Usage: " << program_name << " [options]" << "\n";
+    ss << "Transcode .pgn(.gz) files into seekable .pgn.zst files with frames aligned to games." << "\n";
+    ss << "Options:" << "\n";
+    ss << "  --file <path>         Path to .pgn(.gz) file" << "\n";
+    ss << "  --dir <path>          Path to directory containing .pgn(.gz) files (default: pgns)" << "\n";
+    ss << "  -r                    Search for .pgn(.gz) files recursively in subdirectories" << "\n";
+    ss << "  --concurrency <N>     Number of concurrent threads to use (default: maximum)" << "\n";
+    ss << "  --level <N>           zstd compression level (default: 9)" << "\n";
+    ss << "  --frameSize <N>       Uncompressed size of the frames in KiB (default: 4096)" << "\n";
+    ss << "  --remove              Remove the .pgn(.gz) files after transcoding them" << "\n";
+    ss << "  --help                Print this help message" << "\n";
+    // clang-format on
+
+    std::cout << ss.str();
+}
+
+int main(int argc, char const *argv[]) {
+    CommandLine cmd(argc, argv);
+
+    std::vector<std::string> files_pgn;
+    int level              = 9;
+    std::size_t frame_size = 4096 << 10;
+    int concurrency        = std::max(1, int(std::thread::hardware_concurrency()));
+
+    if (cmd.has_argument("--help", true)) {
+        print_usage(argv[0]);
+        return 0;
+    }
+
+    if (cmd.has_argument("--level")) {
+        level = std::min(std::stoi(cmd.get_argument("--level")), ZSTD_maxCLevel());
+    }
+
+    if (cmd.has_argument("--frameSize")) {
+        // decompressed frame sizes are stored in 32 bits
+        frame_size = std::clamp<std::size_t>(std::stoul(cmd.get_argument("--frameSize")), 1,
+                                             1 << 20) << 10;
+    }
+
+    if (cmd.has_argument("--concurrency")) {
+        concurrency = std::stoi(cmd.get_argument("--concurrency"));
+    }
+
+    if (cmd.has_argument("--file")) {
+        files_pgn = {cmd.get_argument("--file")};
+    } else {
+        auto path      = cmd.get_argument("--dir", "./pgns");
+        bool recursive = cmd.has_argument("-r", true);
+
+        files_pgn = get_files(path, recursive);
+    }
+
+    // already transcoded files are skipped
+    const auto it = std::remove_if(files_pgn.begin(), files_pgn.end(), [](const std::string &f) {
+        return f.size() >= 4 && f.substr(f.size() - 4) == ".zst";
+    });
+    files_pgn.erase(it, files_pgn.end());
+
+    std::cout << "Transcoding " << files_pgn.size() << " .pgn(.gz) files." << std::endl;
+
+    const bool remove        = cmd.has_argument("--remove", true);
+    std::atomic<bool> failed = false;
+    std::mutex output_mutex;
+
+    {
+        ThreadPool pool(concurrency);
+
+        for (const auto &file : files_pgn) {
+            pool.enqueue([&, file]() {
+                const auto zst_file = transcode(file, frame_size, level);
+
+                if (zst_file.empty()) {
+                    failed = true;
+                    return;
+                }
+
+                if (remove) {
+                    fs::remove(file);
+                }
+
+                total_files++;
+
+                const std::lock_guard<std::mutex> lock(output_mutex);
+                std::cout << "\rTranscoded " << total_files << "/" << files_pgn.size()
+                          << std::flush;
+            });
+        }
+
+        pool.wait();
+    }
+
+    std::cout << "\nWrote " << total_bytes << " bytes of pgn to " << total_files
+              << " .pgn.zst files." << std::endl;
+
+    if (!remove && total_files > 0) {
+        std::cout << "Remove the original .pgn(.gz) files, or scoreWDLstat will report them as "
+                     "duplicates."
+                  << std::endl;
+    }
+
+    return failed ? 1 : 0;
+}
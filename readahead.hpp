@@ -0,0 +1,387 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define USE_IO_URING
+#endif
+#endif
+
+namespace read_ahead {
+
+/// @brief A read of the range [offset, offset + size) of a file, or of all of it if size is 0.
+struct Request {
+    std::size_t id;
+    std::string file;
+    std::uint64_t offset = 0;
+    std::uint64_t size   = 0;
+
+    std::unique_ptr<char[]> data;
+    bool ok = false;
+
+    // progress of the read
+    int fd             = -1;
+    std::uint64_t done = 0;
+};
+
+/// @brief Reads files asynchronously with io_uring, or, where io_uring is not available, e.g.
+/// before Linux 5.6 or when a container forbids it, with a few threads after posix_fadvise tells
+/// the kernel to start reading. The caller bounds the number of reads in flight.
+class Reader {
+   public:
+    explicit Reader(unsigned depth) {
+#ifdef USE_IO_URING
+        if (setup_ring(std::max(depth, 1u))) {
+            return;
+        }
+#endif
+
+        for (unsigned i = 0; i < std::clamp(depth, 1u, 8u); ++i) {
+            threads.emplace_back([this] { work(); });
+        }
+    }
+
+    ~Reader() {
+        {
+            const std::lock_guard<std::mutex> lock(mutex);
+            stopped = true;
+        }
+
+        condition.notify_all();
+
+        for (auto &thread : threads) {
+            thread.join();
+        }
+
+#ifdef USE_IO_URING
+        if (ring_fd >= 0) {
+            munmap(sqes, sqes_size);
+            munmap(sq_ring, sq_ring_size);
+            if (cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+            close(ring_fd);
+        }
+#endif
+    }
+
+    Reader(const Reader &)            = delete;
+    Reader &operator=(const Reader &) = delete;
+
+    const char *backend() const { return threads.empty() ? "io_uring" : "threads"; }
+
+    std::size_t in_flight() const { return pending; }
+
+    /// @brief Open the file and start reading it.
+    void submit(std::unique_ptr<Request> request) {
+        pending++;
+
+#ifdef __linux__
+        request->fd = open(request->file.c_str(), O_RDONLY);
+
+        struct stat st;
+
+        if (request->fd < 0 || fstat(request->fd, &st) != 0) {
+            return finish(std::move(request), false);
+        }
+
+        if (request->size == 0) {
+            request->size = std::uint64_t(st.st_size) - std::min<std::uint64_t>(
+                                                            request->offset, st.st_size);
+        }
+
+        request->data.reset(new char[std::max<std::uint64_t>(request->size, 1)]);
+
+        if (request->size == 0) {
+            return finish(std::move(request), true);
+        }
+
+#ifdef USE_IO_URING
+        if (ring_fd >= 0) {
+            return submit_read(request.release());
+        }
+#endif
+
+        posix_fadvise(request->fd, request->offset, request->size, POSIX_FADV_WILLNEED);
+
+        {
+            const std::lock_guard<std::mutex> lock(mutex);
+            queued.push_back(std::move(request));
+        }
+
+        condition.notify_one();
+#else
+        finish(std::move(request), false);
+#endif
+    }
+
+    /// @brief Wait for the next completed read.
+    /// @return the request, or nullptr if no read is in flight
+    [[nodiscard]] std::unique_ptr<Request> wait() {
+        if (pending == 0) {
+            return nullptr;
+        }
+
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+
+#ifdef USE_IO_URING
+                if (ring_fd < 0 || !completed.empty())
+#endif
+                {
+                    condition.wait(lock, [this] { return !completed.empty(); });
+
+                    auto request = std::move(completed.front());
+                    completed.pop_front();
+                    pending--;
+
+                    return request;
+                }
+            }
+
+#ifdef USE_IO_URING
+            reap();
+#endif
+        }
+    }
+
+   private:
+    void finish(std::unique_ptr<Request> request, bool ok) {
+#ifdef __linux__
+        if (request->fd >= 0) {
+            close(request->fd);
+            request->fd = -1;
+        }
+#endif
+
+        request->ok = ok;
+
+        {
+            const std::lock_guard<std::mutex> lock(mutex);
+            completed.push_back(std::move(request));
+        }
+
+        condition.notify_all();
+    }
+
+    /// @brief Blocking reads of the fallback threads.
+    void work() {
+        while (true) {
+            std::unique_ptr<Request> request;
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock, [this] { return stopped || !queued.empty(); });
+
+                if (queued.empty()) return;
+
+                request = std::move(queued.front());
+                queued.pop_front();
+            }
+
+#ifdef __linux__
+            bool ok = true;
+
+            while (ok && request->done < request->size) {
+                const auto offset = request->offset + request->done;
+                const auto n      = pread(request->fd, request->data.get() + request->done,
+                                          request->size - request->done, offset);
+
+                if (n > 0) {
+                    request->done += n;
+                } else if (n == 0) {
+                    // the file is shorter than it was
+                    request->size = request->done;
+                } else if (errno != EINTR) {
+                    ok = false;
+                }
+            }
+
+            finish(std::move(request), ok);
+#endif
+        }
+    }
+
+#ifdef USE_IO_URING
+    bool setup_ring(unsigned entries) {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+
+        ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+
+        if (ring_fd < 0) {
+            return false;
+        }
+
+        params_sq = params.sq_off;
+        params_cq = params.cq_off;
+
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        sqes_size    = params.sq_entries * sizeof(io_uring_sqe);
+
+        const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+
+        if (single_mmap) {
+            sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+        }
+
+        const auto map = [&](std::size_t size, off_t offset) {
+            void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring_fd, offset);
+            return ptr == MAP_FAILED ? nullptr : static_cast<char *>(ptr);
+        };
+
+        sq_ring = map(sq_ring_size, IORING_OFF_SQ_RING);
+        cq_ring = single_mmap ? sq_ring : map(cq_ring_size, IORING_OFF_CQ_RING);
+        sqes    = reinterpret_cast<io_uring_sqe *>(map(sqes_size, IORING_OFF_SQES));
+
+        if (!sq_ring || !cq_ring || !sqes || !probe_read()) {
+            if (sqes) munmap(sqes, sqes_size);
+            if (cq_ring && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+            if (sq_ring) munmap(sq_ring, sq_ring_size);
+            close(ring_fd);
+            ring_fd = -1;
+            return false;
+        }
+
+        return true;
+    }
+
+    unsigned *sq_field(std::uint32_t offset) {
+        return reinterpret_cast<unsigned *>(sq_ring + offset);
+    }
+
+    unsigned *cq_field(std::uint32_t offset) {
+        return reinterpret_cast<unsigned *>(cq_ring + offset);
+    }
+
+    /// @brief IORING_OP_READ needs Linux 5.6, older kernels fail the read with EINVAL.
+    bool probe_read() {
+        const int fd = open("/dev/null", O_RDONLY);
+        char byte;
+
+        if (fd < 0) return false;
+
+        push(IORING_OP_READ, fd, &byte, 1, 0, 0);
+        const bool ok = enter(1, 1) >= 0 && pop().second >= 0;
+
+        close(fd);
+        return ok;
+    }
+
+    void push(std::uint8_t opcode, int fd, void *addr, std::uint32_t len, std::uint64_t offset,
+              std::uint64_t user_data) {
+        const unsigned tail  = *sq_field(params_sq.tail);
+        const unsigned index = tail & *sq_field(params_sq.ring_mask);
+
+        io_uring_sqe *sqe = &sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode    = opcode;
+        sqe->fd        = fd;
+        sqe->addr      = reinterpret_cast<std::uint64_t>(addr);
+        sqe->len       = len;
+        sqe->off       = offset;
+        sqe->user_data = user_data;
+
+        sq_field(params_sq.array)[index] = index;
+        __atomic_store_n(sq_field(params_sq.tail), tail + 1, __ATOMIC_RELEASE);
+    }
+
+    int enter(unsigned to_submit, unsigned min_complete) {
+        int ret;
+
+        do {
+            ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                          min_complete ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        } while (ret < 0 && errno == EINTR);
+
+        return ret;
+    }
+
+    /// @brief Wait for one completion.
+    /// @return its user data and result
+    std::pair<std::uint64_t, int> pop() {
+        while (true) {
+            const unsigned head = *cq_field(params_cq.head);
+            const unsigned tail = __atomic_load_n(cq_field(params_cq.tail), __ATOMIC_ACQUIRE);
+
+            if (head != tail) {
+                const auto cqes = reinterpret_cast<io_uring_cqe *>(cq_ring + params_cq.cqes);
+                const auto &cqe = cqes[head & *cq_field(params_cq.ring_mask)];
+                const std::pair<std::uint64_t, int> result(cqe.user_data, cqe.res);
+
+                __atomic_store_n(cq_field(params_cq.head), head + 1, __ATOMIC_RELEASE);
+                return result;
+            }
+
+            enter(0, 1);
+        }
+    }
+
+    void submit_read(Request *request) {
+        // a single read returns at most about 2GiB, larger ranges are read in parts of 1GiB
+        const auto size = std::min<std::uint64_t>(request->size - request->done, 1 << 30);
+
+        push(IORING_OP_READ, request->fd, request->data.get() + request->done, size,
+             request->offset + request->done, reinterpret_cast<std::uint64_t>(request));
+        enter(1, 0);
+    }
+
+    /// @brief Wait for a read to complete, continuing short reads.
+    void reap() {
+        const auto [user_data, res] = pop();
+        auto request = reinterpret_cast<Request *>(user_data);
+
+        if (res > 0) {
+            request->done += res;
+        } else if (res == 0) {
+            // the file is shorter than it was
+            request->size = request->done;
+        } else if (res != -EAGAIN && res != -EINTR) {
+            return finish(std::unique_ptr<Request>(request), false);
+        }
+
+        if (request->done < request->size) {
+            return submit_read(request);
+        }
+
+        finish(std::unique_ptr<Request>(request), true);
+    }
+
+    int ring_fd = -1;
+    char *sq_ring = nullptr, *cq_ring = nullptr;
+    io_uring_sqe *sqes = nullptr;
+    std::size_t sq_ring_size = 0, cq_ring_size = 0, sqes_size = 0;
+    io_sqring_offsets params_sq{};
+    io_cqring_offsets params_cq{};
+#endif
+
+    std::vector<std::thread> threads;
+    std::deque<std::unique_ptr<Request>> queued;
+    std::deque<std::unique_ptr<Request>> completed;
+    std::size_t pending = 0;
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool stopped = false;
+};
+
+}  // namespace read_ahead
@@ -1,19 +1,29 @@
 #include "scoreWDLstat.hpp"
 
+#include <algorithm>
 #include <atomic>
+#include <charconv>
 #include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
+#include <functional>
+#include <iomanip>
 #include <iostream>
 #include <limits>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <new>
 #include <numeric>
 #include <regex>
 #include <set>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -21,579 +31,2910 @@
 #include "external/gzip/gzstream.h"
 #include "external/parallel_hashmap/phmap.h"
 #include "external/threadpool.hpp"
+#include "numa.hpp"
+#include "readahead.hpp"
+#include "tarstream.hpp"
+
+#ifdef USE_ZSTD
+#include "zstdstream.hpp"
+#endif
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 namespace fs = std::filesystem;
 using json   = nlohmann::json;
 
 using namespace chess;
 
-// unordered map to count (result, move, material, eval) tuples in pgns
-using map_t =
-    phmap::parallel_flat_hash_map<Key, int, std::hash<Key>, std::equal_to<Key>,
-                                  std::allocator<std::pair<const Key, int>>, 8, std::mutex>;
+// map to accumulate the counts of the binned evals for the output
+using map_binned_t =
+    phmap::flat_hash_map<PackedKey, std::uint64_t, std::hash<PackedKey>, std::equal_to<PackedKey>>;
 
 // map to collect metadata for tests
 using map_meta = std::unordered_map<std::string, TestMetaData>;
 
-// map to hold move counters that cutechess-cli changed from original FENs
-using map_fens = std::unordered_map<std::string, std::pair<int, int>>;
+// map to hold move counters that cutechess-cli changed from original FENs, allows lookups with
+// std::string_view
+using map_fens = phmap::flat_hash_map<std::string, std::pair<int, int>>;
 
 // concurrent position map
 map_t pos_map                         = {};
+
+// with --numa the position maps of the NUMA nodes, merged into pos_map at the end
+std::vector<std::unique_ptr<map_t>> node_maps;
+
+// the position map the current thread counts into
+thread_local map_t *local_map = &pos_map;
+
 std::atomic<std::size_t> total_chunks = 0;
 std::atomic<std::size_t> total_games  = 0;
 
-namespace analysis {
+// statistics of the SAN caches of all workers
+std::atomic<std::uint64_t> san_lookups = 0;
+std::atomic<std::uint64_t> san_hits    = 0;
 
-/// @brief Magic value for fishtest pgns, ~1.2 million keys
-static constexpr int map_size = 1200000;
+// heap allocations of the current thread, and the results of --checkAllocations
+thread_local std::uint64_t thread_allocations = 0;
+bool check_allocations                        = false;
+std::atomic<std::uint64_t> checked_games      = 0;
+std::atomic<std::uint64_t> allocating_games   = 0;
 
-/// @brief Analyze a file with pgn games and update the position map, apply filter if present
-class Analyze : public pgn::Visitor {
-   public:
-    Analyze(std::string_view file, const std::string &regex_engine, const map_fens &fixfen_map,
-            const int bin_width)
-        : file(file), regex_engine(regex_engine), fixfen_map(fixfen_map), bin_width(bin_width) {}
+// replacements of the global allocation functions counting thread_allocations, not inlined such
+// that the compiler does not match malloc/free against the new/delete expressions of the callers
+[[gnu::noinline]] void *operator new(std::size_t size) {
+    thread_allocations++;
 
-    virtual ~Analyze() {}
+    if (void *ptr = std::malloc(size ? size : 1)) {
+        return ptr;
+    }
 
-    void startPgn() override {}
+    throw std::bad_alloc();
+}
 
-    void startMoves() override {
-        if (!skip) {
-            total_games++;
+[[gnu::noinline]] void operator delete(void *ptr) noexcept { std::free(ptr); }
+
+[[gnu::noinline]] void operator delete(void *ptr, std::size_t) noexcept { std::free(ptr); }
+
+/// @brief A field of /proc/self/status in bytes, e.g. VmRSS or VmHWM for the peak resident memory.
+/// @param field
+/// @return 0 where /proc is not available
+[[nodiscard]] std::uint64_t process_memory(const std::string &field) {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+
+    while (std::getline(status, line)) {
+        if (line.size() > field.size() && line.compare(0, field.size(), field) == 0 &&
+            line[field.size()] == ':') {
+            // the values are in kB
+            return std::stoull(line.substr(field.size() + 1)) << 10;
         }
+    }
 
-        do_filter = !regex_engine.empty();
+    return 0;
+}
 
-        if (do_filter) {
-            if (white.empty() || black.empty()) {
-                return;
-            }
+/// @brief With --maxMemory, the maps are written to spill files whenever they hold the entries
+/// planned for them, between files or at a game boundary within a file, and are then cleared,
+/// keeping their capacity. The spilled counts are summed again when binning the output.
+class Spill {
+   public:
+    void enable(const std::string &spill_prefix, std::size_t map_slots) {
+        prefix = spill_prefix;
+        slots  = map_slots;
 
-            std::regex regex(regex_engine);
+        remove_stale();
 
-            if (std::regex_match(white, regex)) {
-                filter_side = Color::WHITE;
-            }
+        // keep each submap below its load factor of 7/8, with room for the spread of the keys
+        // over the submaps
+        const auto growth = map_slots - map_slots / 8;
+        max_entries       = growth - growth / 8;
+    }
 
-            if (std::regex_match(black, regex)) {
-                if (filter_side == Color::NONE) {
-                    filter_side = Color::BLACK;
-                } else {
-                    do_filter = false;
-                }
-            }
+    bool enabled() const { return !prefix.empty(); }
+
+    std::size_t map_slots() const { return slots; }
+
+    std::size_t file_count() const { return files.size(); }
+
+    std::uint64_t entries() const { return spilled; }
+
+    /// @brief Whether the maps hold the entries planned for them.
+    bool full() const {
+        if (!enabled()) return false;
+
+        std::size_t size = pos_map.size();
+
+        for (const auto &map : node_maps) {
+            size += map->size();
         }
+
+        return size >= max_entries;
     }
 
-    void header(std::string_view key, std::string_view value) override {
-        if (key == "FEN") {
-            std::regex p("^(.+) 0 1$");
-            std::smatch match;
-            std::string value_str(value);
-
-            // revert changes by cutechess-cli to move counters
-            if (!fixfen_map.empty() && std::regex_search(value_str, match, p) && match.size() > 1) {
-                std::string fen = match[1];
-                auto it         = fixfen_map.find(fen);
-
-                if (it == fixfen_map.end()) {
-                    std::cerr << "While parsing " << file << " could not find FEN " << fen
-                              << " in fixFENsource." << std::endl;
-                    std::exit(1);
-                }
+    /// @brief Write the counts of all maps to a new spill file and clear the maps. No worker may
+    /// change the maps meanwhile.
+    void write() {
+        const std::string filename = prefix + std::to_string(files.size());
+        std::ofstream out(filename, std::ios::binary | std::ios::trunc);
 
-                const auto &fix = it->second;
-                std::string fixed_value =
-                    fen + " " + std::to_string(fix.first) + " " + std::to_string(fix.second);
-                board.setFen(fixed_value);
-            } else {
-                board.setFen(value);
+        const auto write_map = [&](map_t &map) {
+            for (const auto &pair : map) {
+                const std::uint32_t entry[2] = {pair.first.data, pair.second};
+                out.write(reinterpret_cast<const char *>(entry), sizeof(entry));
             }
+
+            spilled += map.size();
+            map.clear();
+        };
+
+        write_map(pos_map);
+
+        for (auto &map : node_maps) {
+            write_map(*map);
         }
 
-        if (key == "Variant" && value == "fischerandom") {
-            board.set960(true);
+        out.close();
+
+        if (!out) {
+            std::cerr << "\nError: Could not write spill file " << filename << std::endl;
+            std::exit(1);
         }
 
-        if (key == "Result") {
-            hasResult  = true;
-            goodResult = true;
+        files.push_back(filename);
+    }
 
-            if (value == "1-0") {
-                resultkey.white = Result::WIN;
-                resultkey.black = Result::LOSS;
-            } else if (value == "0-1") {
-                resultkey.white = Result::LOSS;
-                resultkey.black = Result::WIN;
-            } else if (value == "1/2-1/2") {
-                resultkey.white = Result::DRAW;
-                resultkey.black = Result::DRAW;
-            } else {
-                goodResult = false;
-            }
+    /// @brief Copy entries of a stream in the format of the spill files, e.g. the counts of a
+    /// checkpoint, to a new spill file, without room in the maps.
+    /// @return false if the stream ends early
+    bool write(std::istream &in, std::uint64_t entries) {
+        const std::string filename = prefix + std::to_string(files.size());
+        std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+
+        std::vector<std::uint32_t> buffer(2 << 16);
+
+        for (std::uint64_t left = entries; left > 0 && in;) {
+            const auto n = std::min<std::uint64_t>(left, buffer.size() / 2);
+
+            in.read(reinterpret_cast<char *>(buffer.data()), n * 2 * sizeof(buffer[0]));
+            out.write(reinterpret_cast<const char *>(buffer.data()), in.gcount());
+
+            left -= n;
         }
 
-        if (key == "Termination") {
-            if (value == "time forfeit" || value == "abandoned" || value == "stalled connection" ||
-                value == "illegal move" || value == "unterminated") {
-                goodTermination = false;
-            }
+        out.close();
+
+        if (!out) {
+            std::cerr << "\nError: Could not write spill file " << filename << std::endl;
+            std::exit(1);
         }
 
-        if (key == "White") {
-            white = value;
+        files.push_back(filename);
+        spilled += entries;
+
+        return bool(in);
+    }
+
+    /// @brief Call f(key, count) for all spilled counts.
+    template <typename F>
+    void for_each(F &&f) const {
+        std::vector<std::uint32_t> buffer(2 << 16);
+
+        for (const auto &filename : files) {
+            std::ifstream in(filename, std::ios::binary);
+
+            while (in) {
+                in.read(reinterpret_cast<char *>(buffer.data()), buffer.size() * sizeof(buffer[0]));
+
+                const auto n = std::size_t(in.gcount()) / (2 * sizeof(buffer[0]));
+
+                for (std::size_t i = 0; i < n; ++i) {
+                    PackedKey key;
+                    key.data = buffer[2 * i];
+                    f(key, buffer[2 * i + 1]);
+                }
+            }
+
+            if (!in.eof()) {
+                std::cerr << "Error: Could not read spill file " << filename << std::endl;
+                std::exit(1);
+            }
         }
+    }
 
-        if (key == "Black") {
-            black = value;
+    void remove() {
+        for (const auto &filename : files) {
+            std::error_code ec;
+            fs::remove(filename, ec);
         }
 
-        skip = !(hasResult && goodTermination && goodResult);
+        files.clear();
+        spilled = 0;
     }
 
-    void move(std::string_view move, std::string_view comment) override {
-        if (skip) {
-            return;
+   private:
+    /// @brief Remove the spill files of an interrupted run, whose counts are in its checkpoint if
+    /// it is resumed. The names of the files start again at 0 in every run, such that a resumed run
+    /// would not overwrite all of them.
+    void remove_stale() const {
+        const fs::path path(prefix);
+        const fs::path dir     = path.has_parent_path() ? path.parent_path() : fs::path(".");
+        const std::string stem = path.filename().string();
+
+        std::error_code ec;
+
+        for (const auto &entry : fs::directory_iterator(dir, ec)) {
+            const std::string name = entry.path().filename().string();
+
+            if (name.size() > stem.size() && name.compare(0, stem.size(), stem) == 0 &&
+                std::all_of(name.begin() + stem.size(), name.end(),
+                            [](char c) { return c >= '0' && c <= '9'; })) {
+                fs::remove(entry.path(), ec);
+            }
         }
+    }
 
-        if (board.fullMoveNumber() > 200) {
-            return;
+    std::string prefix;
+    std::size_t slots       = 0;
+    std::size_t max_entries = 0;
+
+    std::vector<std::string> files;
+    std::uint64_t spilled = 0;
+};
+
+Spill spill;
+
+/// @brief With --dedup, the fingerprints of the counted games, such that a game that is found
+/// again, e.g. in the pgn of a test and in the pgns of its runs, is skipped before its moves are
+/// parsed. With --dedupFile, the set is loaded before and saved after a run, such that games
+/// counted by previous runs are skipped as well.
+class GameSet {
+   public:
+    using set_t = phmap::parallel_flat_hash_set<
+        GameFingerprint, std::hash<GameFingerprint>, std::equal_to<GameFingerprint>,
+        std::allocator<GameFingerprint>, 8, std::mutex>;
+
+    void enable() { on = true; }
+
+    bool enabled() const { return on; }
+
+    /// @brief Add the fingerprint of a game, from any thread.
+    /// @return false if the game was added before, i.e. it is a duplicate
+    bool insert(const GameFingerprint &fingerprint) {
+        if (fingerprints.insert(fingerprint).second) {
+            return true;
         }
 
-        // openbench uses Nf3 {+0.57 17/28 583 363004}, fishtest Nf3 {+0.57/17}
-        const size_t delimiter_pos = comment.find_first_of(" /");
+        duplicate_games++;
+        return false;
+    }
 
-        Key key;
-        key.eval = 1002;
+    std::size_t size() const { return fingerprints.size(); }
 
-        if (!do_filter || filter_side == board.sideToMove()) {
-            if (delimiter_pos != std::string::npos && comment != "book") {
-                const auto match_eval = comment.substr(0, delimiter_pos);
+    std::uint64_t duplicates() const { return duplicate_games; }
 
-                if (match_eval[1] == 'M') {
-                    if (match_eval[0] == '+') {
-                        key.eval = 1001;
-                    } else {
-                        key.eval = -1001;
-                    }
+    void write(std::ostream &out) const {
+        const std::uint64_t count = fingerprints.size();
+        out.write(reinterpret_cast<const char *>(&count), sizeof(count));
 
-                } else {
-                    int eval = 100 * fast_stof(match_eval.data());
+        for (const auto &fingerprint : fingerprints) {
+            out.write(reinterpret_cast<const char *>(&fingerprint), sizeof(fingerprint));
+        }
+    }
 
-                    if (eval > 1000) {
-                        eval = 1000;
-                    } else if (eval < -1000) {
-                        eval = -1000;
-                    }
+    /// @return false if the stream ends early
+    bool read(std::istream &in) {
+        std::uint64_t count = 0;
+        in.read(reinterpret_cast<char *>(&count), sizeof(count));
 
-                    // reduce precision
-                    key.eval = int(std::round(eval / float(bin_width))) * bin_width;
-                }
-            }
+        for (std::uint64_t i = 0; in && i < count; ++i) {
+            GameFingerprint fingerprint;
+            in.read(reinterpret_cast<char *>(&fingerprint), sizeof(fingerprint));
+            fingerprints.insert(fingerprint);
         }
 
-        // an eval was found
-        if (key.eval != 1002) {
-            const auto knights = board.pieces(PieceType::KNIGHT).count();
-            const auto bishops = board.pieces(PieceType::BISHOP).count();
-            const auto rooks   = board.pieces(PieceType::ROOK).count();
-            const auto queens  = board.pieces(PieceType::QUEEN).count();
-            const auto pawns   = board.pieces(PieceType::PAWN).count();
+        return bool(in);
+    }
 
-            key.result   = board.sideToMove() == Color::WHITE ? resultkey.white : resultkey.black;
-            key.move     = board.fullMoveNumber();
-            key.material = 9 * queens + 5 * rooks + 3 * bishops + 3 * knights + pawns;
+    /// @brief Load the fingerprints of previous runs.
+    /// @return false if there is no such file
+    bool load(const std::string &filename) {
+        std::ifstream in(filename, std::ios::binary);
 
-            // insert or update the position map
-            pos_map.lazy_emplace_l(
-                std::move(key), [&](map_t::value_type &v) { v.second += 1; },
-                [&](const map_t::constructor &ctor) { ctor(std::move(key), 1); });
+        if (!in.is_open()) {
+            return false;
         }
 
-        try {
-            Move m = uci::parseSan(board, move, moves);
-
-            // chess-lib may call move() with empty strings for move
-            if (m == Move::NO_MOVE) {
-                this->skipPgn(true);
-                return;
-            }
+        char header[sizeof(magic)] = {};
+        in.read(header, sizeof(magic));
 
-            board.makeMove<true>(m);
-        } catch (const uci::AmbiguousMoveError &e) {
-            std::cerr << "While parsing " << file << " encountered: " << e.what() << '\n';
-            this->skipPgn(true);
+        if (!in || std::memcmp(header, magic, sizeof(magic)) != 0 || !read(in)) {
+            std::cerr << "Error: " << filename << " is not a complete file of game fingerprints."
+                      << std::endl;
+            std::exit(1);
         }
+
+        return true;
     }
 
-    void endPgn() override {
-        board.set960(false);
-        board.setFen(constants::STARTPOS);
+    /// @brief Write to a temporary file first and rename it, so that a crash while saving never
+    /// destroys the fingerprints of previous runs.
+    void save(const std::string &filename) const {
+        const std::string tmp_filename = filename + ".tmp";
 
-        goodTermination = true;
-        hasResult       = false;
-        goodResult      = false;
+        std::ofstream out(tmp_filename, std::ios::binary | std::ios::trunc);
+        out.write(magic, sizeof(magic));
+        write(out);
+        out.close();
 
-        filter_side = Color::NONE;
+        std::error_code ec;
 
-        white.clear();
-        black.clear();
+        if (out) {
+            fs::rename(tmp_filename, filename, ec);
+        }
+
+        if (!out || ec) {
+            std::cerr << "Error: Could not write " << filename << std::endl;
+            fs::remove(tmp_filename, ec);
+        }
     }
 
    private:
-    std::string_view file;
-    const std::string &regex_engine;
-    const map_fens &fixfen_map;
-    const int bin_width;
+    static constexpr char magic[8] = {'W', 'D', 'L', 'G', 'A', 'M', 'E', '1'};
 
-    Board board;
-    Movelist moves;
+    bool on = false;
+    set_t fingerprints;
+    std::atomic<std::uint64_t> duplicate_games = 0;
+};
 
-    bool skip = false;
+GameSet game_set;
 
-    bool goodTermination = true;
-    bool hasResult       = false;
-    bool goodResult      = false;
+/// @brief Periodically saves pos_map, total_games, the list of completed files and the game
+/// fingerprints of --dedup, such that an interrupted run can be resumed. Workers enter the gate
+/// only between files, so a checkpoint never contains the partial counts or fingerprints of a
+/// file. The price is that a checkpoint waits for the slowest file in progress, while the
+/// workers that finished their files wait at the gate. The maps may be spilled within a file, see
+/// within(), but as a checkpoint waits for the files in progress, the files whose counts are in a
+/// spill file are completed by the time it is saved.
+class Checkpoint {
+   public:
+    void enable(const std::string &checkpoint_filename, const std::string &checkpoint_config,
+                int interval_seconds) {
+        filename = checkpoint_filename;
+        config   = checkpoint_config;
+        interval = std::chrono::seconds(interval_seconds);
+        gated    = true;
+    }
 
-    bool do_filter    = false;
-    Color filter_side = Color::NONE;
+    bool enabled() const { return !filename.empty(); }
 
-    std::string white;
-    std::string black;
+    /// @brief Let workers pass the gate also without checkpoints, for exclusive().
+    void enable_gate() { gated = true; }
 
-    ResultKey resultkey;
-};
+    void enter() {
+        if (!gated) return;
 
-void ana_files(const std::vector<std::string> &files, const std::string &regex_engine,
-               const map_fens &fixfen_map, const int bin_width) {
-    for (const auto &file : files) {
-        const auto pgn_iterator = [&](std::istream &iss) {
-            auto vis = std::make_unique<Analyze>(file, regex_engine, fixfen_map, bin_width);
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [this] { return !pending && !pausing; });
+        active++;
+    }
 
-            pgn::StreamParser parser(iss);
+    void leave(const std::string &file) {
+        if (!gated) return;
 
-            auto error = parser.readGames(*vis);
+        {
+            const std::lock_guard<std::mutex> lock(mutex);
+            completed.insert(file);
+            active--;
+        }
 
-            if (error) {
-                std::cerr << "Error while parsing: " << file << ". Error: " << error.message() << std::endl;
-            }
-        };
+        condition.notify_all();
+    }
 
-        if (file.size() >= 3 && file.substr(file.size() - 3) == ".gz") {
-            igzstream input(file.c_str());
-            pgn_iterator(input);
-        } else {
-            std::ifstream pgn_stream(file);
-            pgn_iterator(pgn_stream);
-            pgn_stream.close();
+    /// @brief Leave without completing a file, after changing the maps outside of a file.
+    void leave() {
+        if (!gated) return;
+
+        {
+            const std::lock_guard<std::mutex> lock(mutex);
+            active--;
         }
+
+        condition.notify_all();
     }
-}
 
-}  // namespace analysis
+    /// @brief Run f while no worker is within a file, e.g. to spill the maps. The caller must not
+    /// be within a file itself.
+    template <typename F>
+    void exclusive(F &&f) {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [this] { return !pending; });
 
-[[nodiscard]] map_fens get_fixfen(std::string file) {
-    map_fens fixfen_map;
-    if (file.empty()) {
-        return fixfen_map;
+        pending = true;
+        condition.wait(lock, [this] { return active == 0; });
+
+        f();
+
+        pending = false;
+        condition.notify_all();
     }
 
-    const auto fen_iterator = [&](std::istream &iss) {
-        std::string line;
-        while (std::getline(iss, line)) {
-            std::istringstream iss(line);
-            std::string f1, f2, f3, ep;
-            int halfmove, fullmove = 0;
+    /// @brief Whether a worker waits in within() for the others to pause().
+    bool pause_requested() const { return pausing.load(std::memory_order_relaxed); }
 
-            iss >> f1 >> f2 >> f3 >> ep >> halfmove >> fullmove;
+    /// @brief Wait at a game boundary within a file while another worker runs within().
+    void pause() {
+        std::unique_lock<std::mutex> lock(mutex);
+        wait_paused(lock);
+    }
 
-            if (!fullmove) continue;
+    /// @brief Run f at a game boundary within a file, while the other workers within files pause
+    /// at theirs and none enters a file, e.g. to spill the maps in the middle of a large file. If
+    /// another worker runs within() already, pause for it instead.
+    template <typename F>
+    void within(F &&f) {
+        if (!gated) return;
 
-            auto key         = f1 + ' ' + f2 + ' ' + f3 + ' ' + ep;
-            auto fixfen_data = std::pair<int, int>(halfmove, fullmove);
+        std::unique_lock<std::mutex> lock(mutex);
 
-            if (fixfen_map.find(key) != fixfen_map.end()) {
-                // for duplicate FENs, prefer the one with lower full move counter
-                if (fullmove < fixfen_map[key].second) {
-                    fixfen_map[key] = fixfen_data;
-                }
-            } else {
-                fixfen_map[key] = fixfen_data;
-            }
+        if (pausing) {
+            wait_paused(lock);
+            return;
         }
-    };
 
-    if (file.size() >= 3 && file.substr(file.size() - 3) == ".gz") {
-        igzstream input(file.c_str());
-        fen_iterator(input);
-    } else {
-        std::ifstream input(file);
-        fen_iterator(input);
-    }
+        pausing = true;
+        condition.wait(lock, [this] { return active - paused == 1; });
 
-    return fixfen_map;
-}
+        f();
 
-[[nodiscard]] map_meta get_metadata(const std::vector<std::string> &file_list,
-                                    bool allow_duplicates) {
-    map_meta meta_map;
-    // map to check for duplicate tests
-    std::unordered_map<std::string, std::string> test_map;
-    std::set<std::string> test_warned;
+        pausing = false;
+        condition.notify_all();
+    }
 
-    for (const auto &pathname : file_list) {
-        fs::path path(pathname);
-        std::string filename      = path.filename().string();
-        std::string test_id       = filename.substr(0, filename.find_first_of("-."));
-        std::string test_filename = (path.parent_path() / test_id).string();
+    /// @brief Write a checkpoint every interval, until stop() is called.
+    void start() {
+        if (!enabled()) return;
 
-        if (test_map.find(test_id) == test_map.end()) {
-            test_map[test_id] = test_filename;
-        } else if (test_map[test_id] != test_filename) {
-            if (test_warned.find(test_filename) == test_warned.end()) {
-                std::cout << (allow_duplicates ? "Warning" : "Error")
-                          << ": Detected a duplicate of test " << test_id << " in directory "
-                          << path.parent_path().string() << std::endl;
-                test_warned.insert(test_filename);
+        writer = std::thread([this] {
+            std::unique_lock<std::mutex> lock(mutex);
 
-                if (!allow_duplicates) {
-                    std::cout << "Use --allowDuplicates to continue nonetheless." << std::endl;
-                    std::exit(1);
-                }
-            }
-        }
+            while (!condition.wait_for(lock, interval, [this] { return stopped; })) {
+                pending = true;
+                condition.wait(lock, [this] { return active == 0; });
 
-        // load the JSON data from disk, only once for each test
-        if (meta_map.find(test_filename) == meta_map.end()) {
-            std::ifstream json_file(test_filename + ".json");
+                save();
 
-            if (!json_file.is_open()) continue;
+                pending = false;
+                condition.notify_all();
+            }
+        });
+    }
 
-            json metadata = json::parse(json_file);
+    void stop() {
+        if (!writer.joinable()) return;
 
-            meta_map[test_filename] = metadata.get<TestMetaData>();
+        {
+            const std::lock_guard<std::mutex> lock(mutex);
+            stopped = true;
         }
+
+        condition.notify_all();
+        writer.join();
     }
 
-    return meta_map;
+    /// @brief Load the completed files, total_games and game_set of a previous checkpoint. The
+    /// counts follow with load_counts(), once the memory is planned with the loaded fingerprints.
+    /// @return false if there is no checkpoint file
+    bool load() {
+        std::ifstream in(filename, std::ios::binary);
+
+        if (!in.is_open()) {
+            return false;
+        }
+
+        char header[sizeof(magic)] = {};
+        in.read(header, sizeof(magic));
+
+        if (!in || std::string(header, sizeof(magic)) != std::string(magic, sizeof(magic))) {
+            fail("not a checkpoint file.");
+        }
+
+        if (read_string(in) != config) {
+            fail("it was written with different options.");
+        }
+
+        std::uint64_t games = 0, files = 0;
+        in.read(reinterpret_cast<char *>(&games), sizeof(games));
+        in.read(reinterpret_cast<char *>(&files), sizeof(files));
+
+        for (std::uint64_t i = 0; in && i < files; ++i) {
+            completed.insert(read_string(in));
+        }
+
+        if (!in || !game_set.read(in)) {
+            fail("the file is truncated.");
+        }
+
+        total_games   = games;
+        counts_offset = in.tellg();
+
+        return true;
+    }
+
+    /// @brief Load the counts of the checkpoint read by load() into pos_map, or copy them to a
+    /// spill file with --maxMemory. The counts of a key that was saved from several maps or spill
+    /// files are summed.
+    void load_counts() {
+        std::ifstream in(filename, std::ios::binary);
+        in.seekg(counts_offset);
+
+        std::uint64_t entries = 0;
+        in.read(reinterpret_cast<char *>(&entries), sizeof(entries));
+
+        // the entries are ordered by submap, inserting them would fill one submap after the other
+        // past the plan
+        if (spill.enabled()) {
+            if (!in || !spill.write(in, entries)) {
+                fail("the file is truncated.");
+            }
+
+            return;
+        }
+
+        for (std::uint64_t i = 0; in && i < entries; ++i) {
+            std::uint32_t entry[2];
+            in.read(reinterpret_cast<char *>(entry), sizeof(entry));
+
+            PackedKey key;
+            key.data     = entry[0];
+            pos_map[key] += entry[1];
+        }
+
+        if (!in) {
+            fail("the file is truncated.");
+        }
+    }
+
+    bool is_completed(const std::string &file) {
+        const std::lock_guard<std::mutex> lock(mutex);
+        return completed.find(file) != completed.end();
+    }
+
+    std::size_t completed_count() const { return completed.size(); }
+
+    /// @brief Remove the checkpoint after the final results have been saved.
+    void remove() const {
+        if (enabled()) {
+            std::error_code ec;
+            fs::remove(filename, ec);
+        }
+    }
+
+   private:
+    void wait_paused(std::unique_lock<std::mutex> &lock) {
+        paused++;
+        condition.notify_all();
+        condition.wait(lock, [this] { return !pausing; });
+        paused--;
+    }
+
+    /// @brief Write to a temporary file first and rename it, so that a crash while saving
+    /// never destroys the previous checkpoint.
+    void save() const {
+        const std::string tmp_filename = filename + ".tmp";
+
+        {
+            std::ofstream out(tmp_filename, std::ios::binary | std::ios::trunc);
+
+            out.write(magic, sizeof(magic));
+            write_string(out, config);
+
+            const std::uint64_t games = total_games, files = completed.size();
+            out.write(reinterpret_cast<const char *>(&games), sizeof(games));
+            out.write(reinterpret_cast<const char *>(&files), sizeof(files));
+
+            for (const auto &file : completed) {
+                write_string(out, file);
+            }
+
+            game_set.write(out);
+
+            std::uint64_t entries = pos_map.size() + spill.entries();
+
+            for (const auto &map : node_maps) {
+                entries += map->size();
+            }
+
+            out.write(reinterpret_cast<const char *>(&entries), sizeof(entries));
+
+            const auto write_map = [&](const map_t &map) {
+                for (const auto &pair : map) {
+                    const std::uint32_t entry[2] = {pair.first.data, pair.second};
+                    out.write(reinterpret_cast<const char *>(entry), sizeof(entry));
+                }
+            };
+
+            write_map(pos_map);
+
+            for (const auto &map : node_maps) {
+                write_map(*map);
+            }
+
+            spill.for_each([&](PackedKey key, std::uint32_t count) {
+                const std::uint32_t entry[2] = {key.data, count};
+                out.write(reinterpret_cast<const char *>(entry), sizeof(entry));
+            });
+
+            out.close();
+
+            if (!out) {
+                std::cerr << "\nWarning: Could not write checkpoint " << tmp_filename << std::endl;
+                return;
+            }
+        }
+
+        std::error_code ec;
+        fs::rename(tmp_filename, filename, ec);
+
+        if (ec) {
+            std::cerr << "\nWarning: Could not write checkpoint " << filename << ": "
+                      << ec.message() << std::endl;
+        }
+    }
+
+    static void write_string(std::ostream &out, const std::string &str) {
+        const std::uint64_t size = str.size();
+        out.write(reinterpret_cast<const char *>(&size), sizeof(size));
+        out.write(str.data(), size);
+    }
+
+    static std::string read_string(std::istream &in) {
+        std::uint64_t size = 0;
+        in.read(reinterpret_cast<char *>(&size), sizeof(size));
+
+        // guard against corrupt files, no path or option string comes close to this
+        if (!in || size > (1 << 20)) {
+            in.setstate(std::ios::failbit);
+            return {};
+        }
+
+        std::string str(size, '\0');
+        in.read(str.data(), size);
+        return str;
+    }
+
+    [[noreturn]] void fail(const std::string &reason) const {
+        std::cerr << "Error: Could not resume from " << filename << ": " << reason << std::endl;
+        std::exit(1);
+    }
+
+    static constexpr char magic[8] = {'W', 'D', 'L', 'C', 'K', 'P', 'T', '4'};
+
+    std::string filename;
+    std::string config;
+    std::chrono::seconds interval{600};
+    std::streamoff counts_offset = 0;
+
+    std::set<std::string> completed;
+
+    std::thread writer;
+    std::mutex mutex;
+    std::condition_variable condition;
+    int active   = 0;
+    int paused   = 0;
+    bool gated   = false;
+    bool pending = false;
+    bool stopped = false;
+
+    std::atomic<bool> pausing = false;
+};
+
+Checkpoint checkpoint;
+
+/// @brief Spill the maps between files once they hold the entries planned for them.
+void spill_if_full() {
+    if (spill.full()) {
+        checkpoint.exclusive([] {
+            if (spill.full()) spill.write();
+        });
+    }
+}
+
+/// @brief Number of keys a worker adds to the maps between checks of their size within a file,
+/// far below the room the plan leaves for the load factor of the submaps.
+static constexpr std::size_t spill_check_keys = 1024;
+
+/// @brief Keys the worker added to the maps since its last check.
+thread_local std::size_t new_keys = 0;
+
+/// @brief Spill the maps at a game boundary within a file once they hold the entries planned for
+/// them, as a large file would grow them past the plan before it ends. Pauses the worker while
+/// another one spills.
+inline void spill_within_file() {
+    if (checkpoint.pause_requested()) {
+        checkpoint.pause();
+    } else if (new_keys >= spill_check_keys) {
+        new_keys = 0;
+
+        if (spill.full()) {
+            checkpoint.within([] {
+                if (spill.full()) spill.write();
+            });
+        }
+    }
+}
+
+namespace analysis {
+
+/// @brief Magic value for fishtest pgns, ~1.2 million keys with 5cp bins, about 5x that at 1cp
+static constexpr int map_size = 6000000;
+
+/// @brief Direct mapped cache of SAN moves resolved by uci::parseSan, keyed by position hash and
+/// SAN token. Games of a test start from a limited set of book positions, so the early moves
+/// repeat a lot and need no move generation on a hit. Later moves rarely repeat and bypass the
+/// cache, such that they do not evict the openings.
+class SanCache {
+   public:
+    /// @brief Number of plies from the start of a game that use the cache
+    static constexpr int max_ply = 24;
+
+    Move parseSan(const Board &board, std::string_view san, Movelist &moves, int ply) {
+        // longer tokens, e.g. with annotations, are rare and not cached
+        if (ply >= max_ply || san.empty() || san.size() > sizeof(std::uint64_t)) {
+            return uci::parseSan(board, san, moves);
+        }
+
+        std::uint64_t token = 0;
+        std::memcpy(&token, san.data(), san.size());
+
+        // castling moves are encoded differently in chess960
+        const std::uint64_t hash = board.hash() ^ (board.chess960() ? 0x9e3779b97f4a7c15ull : 0);
+        auto &entry = entries[((hash ^ token) * 0x9e3779b97f4a7c15ull) >> (64 - size_bits)];
+
+        lookups++;
+
+        if (entry.hash == hash && entry.token == token) {
+            hits++;
+            return Move(entry.move);
+        }
+
+        const Move m = uci::parseSan(board, san, moves);
+
+        if (m != Move::NO_MOVE) {
+            entry = {hash, token, m.move()};
+        }
+
+        return m;
+    }
+
+    /// @brief Add the statistics of this cache to the totals of all workers.
+    void flush_stats() {
+        san_lookups += lookups;
+        san_hits += hits;
+        lookups = hits = 0;
+    }
+
+   private:
+    struct Entry {
+        std::uint64_t hash;
+        std::uint64_t token;
+        std::uint16_t move;
+    };
+
+    // 2^15 entries of 24 bytes, i.e. 768 KiB, which fits in the L2 of cores with 1 MiB or more
+    // and is served from L3 elsewhere, still much faster than generating the moves
+    static constexpr int size_bits = 15;
+
+    std::vector<Entry> entries = std::vector<Entry>(std::size_t(1) << size_bits, Entry{});
+
+    std::uint64_t lookups = 0;
+    std::uint64_t hits    = 0;
+};
+
+/// @brief One SAN cache per worker thread, shared by all files it processes
+thread_local SanCache san_cache;
+
+/// @brief Space for a FEN header with fixed move counters
+using FenBuffer = std::array<char, 256 + 2 * 12>;
+
+/// @brief Revert the changes by cutechess-cli to the move counters of a FEN, i.e. a FEN
+/// "... 0 1" gets the move counters of fixfen_map. Never allocates.
+/// @param value FEN header of a game in file
+/// @param fixfen_map
+/// @param file
+/// @param buffer storage for the fixed FEN
+/// @return the FEN with the original move counters in buffer, or value if it needs no change
+[[nodiscard]] std::string_view fix_fen(std::string_view value, const map_fens &fixfen_map,
+                                       std::string_view file, FenBuffer &buffer) {
+    static constexpr std::string_view counters = " 0 1";
+
+    if (fixfen_map.empty() || value.size() <= counters.size() || !ends_with(value, counters)) {
+        return value;
+    }
+
+    const auto fen = value.substr(0, value.size() - counters.size());
+    const auto it  = fixfen_map.find(fen);
+
+    if (it == fixfen_map.end()) {
+        std::cerr << "While parsing " << file << " could not find FEN " << fen
+                  << " in fixFENsource." << std::endl;
+        std::exit(1);
+    }
+
+    char *ptr       = std::copy(fen.begin(), fen.end(), buffer.data());
+    char *const end = buffer.data() + buffer.size();
+
+    *ptr++ = ' ';
+    ptr    = std::to_chars(ptr, end, it->second.first).ptr;
+    *ptr++ = ' ';
+    ptr    = std::to_chars(ptr, end, it->second.second).ptr;
+
+    return std::string_view(buffer.data(), ptr - buffer.data());
+}
+
+/// @brief A visitor of the games of a file, see Analyze.
+class FileVisitor : public pgn::Visitor {
+   public:
+    virtual void set_file(std::string_view new_file) = 0;
+};
+
+/// @brief Analyze files with pgn games and update the position map, apply filter if present.
+/// One instance is reused for all files of a worker, such that after warm-up no game or move
+/// allocates memory. The options that are fixed for a run are template parameters, such that
+/// the calls of the parser per header and move do not test them.
+/// @tparam Filter whether only the moves of the engine matching regex_engine are counted
+/// @tparam FixFen whether FEN headers are fixed with fixfen_map
+/// @tparam Dedup whether games already in game_set are skipped
+/// @tparam CheckAllocations whether the allocations of the games are counted
+template <bool Filter, bool FixFen, bool Dedup, bool CheckAllocations>
+class Analyze final : public FileVisitor {
+   public:
+    Analyze(const std::string &regex_engine, const map_fens &fixfen_map)
+        : regex(regex_engine), fixfen_map(fixfen_map) {}
+
+    void set_file(std::string_view new_file) override {
+        file       = new_file;
+        file_games = 0;
+    }
+
+    void startPgn() override {
+        if constexpr (Dedup) {
+            hasher.reset();
+        }
+
+        if constexpr (CheckAllocations) {
+            game_allocations = thread_allocations;
+        }
+    }
+
+    void startMoves() override {
+        if (!skip) {
+            // with Dedup, the game is counted once its fingerprint is known
+            if constexpr (Dedup) {
+                fingerprint_pending = true;
+            } else {
+                total_games++;
+            }
+        }
+
+        if constexpr (Filter) {
+            do_filter = true;
+
+            if (white.empty() || black.empty()) {
+                return;
+            }
+
+            if (matches_engine(white)) {
+                filter_side = Color::WHITE;
+            }
+
+            if (matches_engine(black)) {
+                if (filter_side == Color::NONE) {
+                    filter_side = Color::BLACK;
+                } else {
+                    do_filter = false;
+                }
+            }
+        }
+    }
+
+    void header(std::string_view key, std::string_view value) override {
+        if constexpr (Dedup) {
+            hasher.add(key);
+            hasher.add(value);
+        }
+
+        if (key == "FEN") {
+            if constexpr (FixFen) {
+                // revert changes by cutechess-cli to move counters
+                board.setFen(fix_fen(value, fixfen_map, file, fen_buffer));
+            } else {
+                board.setFen(value);
+            }
+        }
+
+        if (key == "Variant" && value == "fischerandom") {
+            board.set960(true);
+        }
+
+        if (key == "Result") {
+            hasResult  = true;
+            goodResult = true;
+
+            if (value == "1-0") {
+                resultkey.white = Result::WIN;
+                resultkey.black = Result::LOSS;
+            } else if (value == "0-1") {
+                resultkey.white = Result::LOSS;
+                resultkey.black = Result::WIN;
+            } else if (value == "1/2-1/2") {
+                resultkey.white = Result::DRAW;
+                resultkey.black = Result::DRAW;
+            } else {
+                goodResult = false;
+            }
+        }
+
+        if (key == "Termination") {
+            if (value == "time forfeit" || value == "abandoned" || value == "stalled connection" ||
+                value == "illegal move" || value == "unterminated") {
+                goodTermination = false;
+            }
+        }
+
+        // the names are needed only to filter
+        if constexpr (Filter) {
+            if (key == "White") {
+                white = value;
+            }
+
+            if (key == "Black") {
+                black = value;
+            }
+        }
+
+        skip = !(hasResult && goodTermination && goodResult);
+    }
+
+    void move(std::string_view move, std::string_view comment) override {
+        if (skip) {
+            return;
+        }
+
+        // the remaining moves of a duplicate are neither parsed nor counted
+        if constexpr (Dedup) {
+            if (fingerprint_pending) {
+                if (hashed_moves == fingerprint_moves) {
+                    if (is_duplicate()) {
+                        this->skipPgn(true);
+                        return;
+                    }
+                } else {
+                    hasher.add(move);
+                    hasher.add(comment);
+                    hashed_moves++;
+                }
+            }
+        }
+
+        if (board.fullMoveNumber() > 200) {
+            return;
+        }
+
+        Key key;
+        key.eval = no_eval;
+
+        // binning to lower precision is done when saving
+        if (!Filter || !do_filter || filter_side == board.sideToMove()) {
+            key.eval = parse_eval(comment);
+        }
+
+        // an eval was found
+        if (key.eval != no_eval) {
+            key.result   = board.sideToMove() == Color::WHITE ? resultkey.white : resultkey.black;
+            key.move     = board.fullMoveNumber();
+            key.material = material(board);
+
+            const PackedKey packed(key);
+
+            // the positions of the first moves are counted once the game is known to be new
+            if (Dedup && fingerprint_pending) {
+                pending_keys[pending_count++] = packed;
+            } else {
+                count(packed);
+            }
+        }
+
+        try {
+            Move m = san_cache.parseSan(board, move, moves, ply);
+
+            // chess-lib may call move() with empty strings for move
+            if (m == Move::NO_MOVE) {
+                this->skipPgn(true);
+                return;
+            }
+
+            board.makeMove<true>(m);
+            ply++;
+        } catch (const uci::AmbiguousMoveError &e) {
+            std::cerr << "While parsing " << file << " encountered: " << e.what() << '\n';
+            this->skipPgn(true);
+        }
+    }
+
+    void endPgn() override {
+        // a game with at most fingerprint_moves moves
+        if constexpr (Dedup) {
+            if (fingerprint_pending) {
+                is_duplicate();
+            }
+        }
+
+        // the first games of a file warm up the buffers of the parser
+        if constexpr (CheckAllocations) {
+            if (++file_games > warmup_games) {
+                checked_games++;
+
+                if (thread_allocations != game_allocations) {
+                    allocating_games++;
+                }
+            }
+        }
+
+        board.set960(false);
+        board.setFen(constants::STARTPOS);
+        ply = 0;
+
+        goodTermination = true;
+        hasResult       = false;
+        goodResult      = false;
+
+        filter_side = Color::NONE;
+
+        white.clear();
+        black.clear();
+
+        spill_within_file();
+    }
+
+   private:
+    /// @brief Insert or update the position map.
+    void count(PackedKey packed) {
+        const auto allocations = thread_allocations;
+
+        local_map->lazy_emplace_l(
+            packed, [&](map_t::value_type &v) { v.second += 1; },
+            [&](const map_t::constructor &ctor) {
+                ctor(packed, 1);
+                new_keys++;
+            });
+
+        // growing the map allocates, which is not an allocation of the game
+        if constexpr (CheckAllocations) thread_allocations = allocations;
+    }
+
+    /// @brief Look up the fingerprint of the headers and the first moves, whose comments have the
+    /// eval, depth and time of the engine, and count the game and its first positions if it is
+    /// new.
+    bool is_duplicate() {
+        const auto allocations = thread_allocations;
+        const bool duplicate   = !game_set.insert(hasher.finish());
+
+        // growing the set allocates, which is not an allocation of the game
+        if constexpr (CheckAllocations) thread_allocations = allocations;
+
+        if (!duplicate) {
+            for (int i = 0; i < pending_count; ++i) {
+                count(pending_keys[i]);
+            }
+
+            total_games++;
+        }
+
+        fingerprint_pending = false;
+        hashed_moves        = 0;
+        pending_count       = 0;
+
+        return duplicate;
+    }
+
+    /// @brief Whether the engine regex matches the name, cached for the few names of a test.
+    bool matches_engine(std::string_view name) {
+        for (const auto &entry : name_matches) {
+            if (entry.valid && std::string_view(entry.name) == name) {
+                return entry.matches;
+            }
+        }
+
+        auto &entry   = name_matches[next_name_match++ % name_matches.size()];
+        entry.name    = name;
+        entry.valid   = true;
+        entry.matches = std::regex_match(name.begin(), name.end(), regex);
+
+        return entry.matches;
+    }
+
+    static constexpr int warmup_games = 10;
+
+    std::string_view file;
+    const std::regex regex;
+    const map_fens &fixfen_map;
+
+    Board board;
+    Movelist moves;
+    int ply = 0;
+
+    bool skip = false;
+
+    bool goodTermination = true;
+    bool hasResult       = false;
+    bool goodResult      = false;
+
+    bool do_filter    = false;
+    Color filter_side = Color::NONE;
+
+    FixedString<255> white;
+    FixedString<255> black;
+
+    ResultKey resultkey;
+
+    FenBuffer fen_buffer;
+
+    struct NameMatch {
+        FixedString<255> name;
+        bool valid   = false;
+        bool matches = false;
+    };
+
+    std::array<NameMatch, 4> name_matches;
+    std::size_t next_name_match = 0;
+
+    // games are told apart by their headers and first moves, with Dedup
+    static constexpr int fingerprint_moves = 8;
+
+    FingerprintHasher hasher;
+    bool fingerprint_pending = false;
+    int hashed_moves         = 0;
+
+    std::array<PackedKey, fingerprint_moves> pending_keys;
+    int pending_count = 0;
+
+    int file_games                 = 0;
+    std::uint64_t game_allocations = 0;
+};
+
+/// @brief Creates an Analyze specialization, see select_analyze().
+using AnalyzeFactory = std::unique_ptr<FileVisitor> (*)(const std::string &, const map_fens &);
+
+template <bool... Options>
+[[nodiscard]] std::unique_ptr<FileVisitor> make_analyze(const std::string &regex_engine,
+                                                        const map_fens &fixfen_map) {
+    return std::make_unique<Analyze<Options...>>(regex_engine, fixfen_map);
+}
+
+/// @brief The factory of the specialization for the remaining options, the first ones are
+/// already template arguments.
+template <bool... Options>
+[[nodiscard]] AnalyzeFactory select_factory(const bool *options) {
+    if constexpr (sizeof...(Options) == 4) {
+        return make_analyze<Options...>;
+    } else {
+        return *options ? select_factory<Options..., true>(options + 1)
+                        : select_factory<Options..., false>(options + 1);
+    }
+}
+
+/// @brief Select the Analyze specialization for the options of a run, once before processing.
+/// @param regex_engine
+/// @param fixfen_map
+/// @return
+[[nodiscard]] AnalyzeFactory select_analyze(const std::string &regex_engine,
+                                            const map_fens &fixfen_map) {
+    const bool options[] = {!regex_engine.empty(), !fixfen_map.empty(), game_set.enabled(),
+                            check_allocations};
+
+    return select_factory(options);
+}
+
+/// @brief Parse the games of a pgn stream with the visitor.
+/// @param iss
+/// @param name
+/// @param vis
+void parse_pgn(std::istream &iss, std::string_view name, pgn::Visitor &vis) {
+    pgn::StreamParser parser(iss);
+
+    auto error = parser.readGames(vis);
+
+    if (error) {
+        std::cerr << "Error while parsing: " << name << ". Error: " << error.message() << std::endl;
+    }
+}
+
+/// @brief Parse the games of a .pgn(.gz|.zst) source with the visitor.
+/// @param source
+/// @param vis
+void read_pgn(const PgnSource &source, pgn::Visitor &vis) {
+    const auto &file = source.file;
+
+    const auto pgn_iterator = [&](std::istream &iss) { parse_pgn(iss, file, vis); };
+
+    if (ends_with(file, ".gz")) {
+        igzstream input(file.c_str());
+        pgn_iterator(input);
+#ifdef USE_ZSTD
+    } else if (ends_with(file, ".zst")) {
+        zstd::izstream input(file.c_str(), source.begin, source.end);
+        pgn_iterator(input);
+#endif
+    } else {
+        std::ifstream pgn_stream(file);
+        pgn_iterator(pgn_stream);
+        pgn_stream.close();
+    }
+}
+
+/// @brief Binary game archives, written once from pgns and then analysed without any chess logic.
+/// All numbers are little endian, the native byte order of all supported platforms.
+///   file:   magic | u32 number of strings | strings | u64 number of records | records
+///   string: u32 length | bytes, the FENs and player names referenced by the records
+///   record: RecordHeader | plies times (u8 material, i16 eval) before each move
+/// Games that Analyze skips because of their result or termination are not archived. Evals are
+/// stored at 1cp resolution for all plies, engine filters and fixed FENs are applied when scanning.
+namespace archive {
+
+static constexpr char magic[8]           = {'W', 'D', 'L', 'B', 'I', 'N', '0', '1'};
+static constexpr std::uint32_t no_string = 0xFFFFFFFF;
+static constexpr std::size_t ply_size    = 3;
+static constexpr const char *extension   = ".wdlbin";
+
+struct RecordHeader {
+    std::uint32_t fen;    // string index of the FEN, no_string for the start position
+    std::uint32_t white;  // string index of the white player, no_string if missing
+    std::uint32_t black;  // string index of the black player, no_string if missing
+    std::uint8_t result;  // 'W', 'D' or 'L' from white's point of view
+    std::uint8_t reserved;
+    std::uint16_t plies;
+};
+
+static_assert(sizeof(RecordHeader) == 16);
+
+/// @brief Convert a file with pgn games into a binary game archive
+class Archiver : public pgn::Visitor {
+   public:
+    Archiver(std::string_view file) : file(file) {}
+
+    virtual ~Archiver() {}
+
+    void startPgn() override {}
+
+    void startMoves() override {
+        if (skip) {
+            return;
+        }
+
+        record.fen    = fen.empty() ? no_string : string_index(fen);
+        record.white  = white.empty() ? no_string : string_index(white);
+        record.black  = black.empty() ? no_string : string_index(black);
+        record.result = static_cast<std::uint8_t>(resultkey.white);
+        in_record     = true;
+
+        plies.clear();
+    }
+
+    void header(std::string_view key, std::string_view value) override {
+        if (key == "FEN") {
+            board.setFen(value);
+            fen = value;
+        }
+
+        if (key == "Variant" && value == "fischerandom") {
+            board.set960(true);
+        }
+
+        if (key == "Result") {
+            hasResult  = true;
+            goodResult = true;
+
+            if (value == "1-0") {
+                resultkey.white = Result::WIN;
+            } else if (value == "0-1") {
+                resultkey.white = Result::LOSS;
+            } else if (value == "1/2-1/2") {
+                resultkey.white = Result::DRAW;
+            } else {
+                goodResult = false;
+            }
+        }
+
+        if (key == "Termination") {
+            if (value == "time forfeit" || value == "abandoned" || value == "stalled connection" ||
+                value == "illegal move" || value == "unterminated") {
+                goodTermination = false;
+            }
+        }
+
+        if (key == "White") {
+            white = value;
+        }
+
+        if (key == "Black") {
+            black = value;
+        }
+
+        skip = !(hasResult && goodTermination && goodResult);
+    }
+
+    void move(std::string_view move, std::string_view comment) override {
+        if (skip || plies.size() >= ply_size * std::numeric_limits<std::uint16_t>::max()) {
+            return;
+        }
+
+        const std::uint8_t mat  = analysis::material(board);
+        const std::int16_t eval = analysis::parse_eval(comment);
+
+        plies.push_back(static_cast<char>(mat));
+        plies.append(reinterpret_cast<const char *>(&eval), sizeof(eval));
+
+        try {
+            Move m = san_cache.parseSan(board, move, moves, ply);
+
+            // chess-lib may call move() with empty strings for move
+            if (m == Move::NO_MOVE) {
+                this->skipPgn(true);
+                return;
+            }
+
+            board.makeMove<true>(m);
+            ply++;
+        } catch (const uci::AmbiguousMoveError &e) {
+            std::cerr << "While parsing " << file << " encountered: " << e.what() << '\n';
+            this->skipPgn(true);
+        }
+    }
+
+    void endPgn() override {
+        if (in_record) {
+            record.plies = plies.size() / ply_size;
+            records.append(reinterpret_cast<const char *>(&record), sizeof(record));
+            records += plies;
+            record_count++;
+            in_record = false;
+        }
+
+        board.set960(false);
+        board.setFen(constants::STARTPOS);
+        ply = 0;
+
+        goodTermination = true;
+        hasResult       = false;
+        goodResult      = false;
+
+        fen.clear();
+        white.clear();
+        black.clear();
+    }
+
+    /// @brief Write the archive, to a temporary file first such that it is never incomplete.
+    /// @return false on failure
+    bool save(const std::string &archive_filename) const {
+        const std::string tmp_filename = archive_filename + ".tmp";
+
+        std::ofstream out(tmp_filename, std::ios::binary | std::ios::trunc);
+
+        const std::uint32_t string_count = strings.size();
+        out.write(magic, sizeof(magic));
+        out.write(reinterpret_cast<const char *>(&string_count), sizeof(string_count));
+
+        for (const auto &str : strings) {
+            const std::uint32_t size = str.size();
+            out.write(reinterpret_cast<const char *>(&size), sizeof(size));
+            out.write(str.data(), size);
+        }
+
+        out.write(reinterpret_cast<const char *>(&record_count), sizeof(record_count));
+        out.write(records.data(), records.size());
+        out.close();
+
+        std::error_code ec;
+
+        if (out) {
+            fs::rename(tmp_filename, archive_filename, ec);
+        }
+
+        if (!out || ec) {
+            std::cerr << "Error: Could not write " << archive_filename << std::endl;
+            fs::remove(tmp_filename, ec);
+            return false;
+        }
+
+        return true;
+    }
+
+    std::uint64_t games() const { return record_count; }
+
+   private:
+    std::uint32_t string_index(const std::string &str) {
+        const auto it = string_ids.find(str);
+
+        if (it != string_ids.end()) {
+            return it->second;
+        }
+
+        strings.push_back(str);
+        return string_ids[str] = strings.size() - 1;
+    }
+
+    std::string_view file;
+
+    Board board;
+    Movelist moves;
+    int ply = 0;
+
+    bool skip = false;
+
+    bool goodTermination = true;
+    bool hasResult       = false;
+    bool goodResult      = false;
+
+    std::string fen;
+    std::string white;
+    std::string black;
+
+    ResultKey resultkey;
+
+    RecordHeader record = {};
+    bool in_record      = false;
+    std::string plies;
+
+    std::vector<std::string> strings;
+    std::unordered_map<std::string, std::uint32_t> string_ids;
+    std::string records;
+    std::uint64_t record_count = 0;
+};
+
+/// @brief Count the positions of a binary game archive, with the same result as Analyze gives
+/// for the pgn file it was created from.
+/// @param file
+/// @param regex_engine
+/// @param fixfen_map
+void scan(std::string_view data, const std::string &file, const std::string &regex_engine,
+          const map_fens &fixfen_map) {
+    const char *ptr = data.data();
+    const char *end = ptr + data.size();
+
+    const auto fail = [&]() {
+        std::cerr << "Error while scanning: " << file << ". Error: Invalid archive" << std::endl;
+    };
+
+    const auto read = [&](auto &value) {
+        if (std::size_t(end - ptr) < sizeof(value)) return false;
+        std::memcpy(&value, ptr, sizeof(value));
+        ptr += sizeof(value);
+        return true;
+    };
+
+    if (data.size() < sizeof(magic) || std::memcmp(ptr, magic, sizeof(magic)) != 0) {
+        return fail();
+    }
+
+    ptr += sizeof(magic);
+
+    std::uint32_t string_count = 0;
+    if (!read(string_count)) return fail();
+
+    std::vector<std::string_view> strings;
+
+    for (std::uint32_t i = 0; i < string_count; ++i) {
+        std::uint32_t size = 0;
+        if (!read(size) || std::size_t(end - ptr) < size) return fail();
+        strings.emplace_back(ptr, size);
+        ptr += size;
+    }
+
+    // side to move and plies of the FENs, and whether the names match the engine regex,
+    // resolved once per string
+    struct StringInfo {
+        bool resolved = false;
+        Color stm     = Color::WHITE;
+        std::uint16_t plies = 0;
+        int matches   = -1;
+    };
+
+    std::vector<StringInfo> infos(strings.size());
+
+    const std::regex regex(regex_engine);
+    const bool filter = !regex_engine.empty();
+
+    const auto position_info = [&](std::uint32_t fen) -> const StringInfo & {
+        static const StringInfo startpos = {true, Color::WHITE, 0, -1};
+
+        if (fen == no_string) return startpos;
+
+        auto &info = infos.at(fen);
+
+        if (!info.resolved) {
+            analysis::FenBuffer buffer;
+
+            Board board;
+            board.setFen(analysis::fix_fen(strings[fen], fixfen_map, file, buffer));
+
+            info.resolved = true;
+            info.stm      = board.sideToMove();
+            info.plies    = (board.fullMoveNumber() - 1) * 2 + (info.stm == Color::BLACK);
+        }
+
+        return info;
+    };
+
+    const auto matches = [&](std::uint32_t name) {
+        auto &info = infos.at(name);
+
+        if (info.matches < 0) {
+            info.matches = std::regex_match(strings[name].begin(), strings[name].end(), regex);
+        }
+
+        return info.matches == 1;
+    };
+
+    std::uint64_t record_count = 0;
+    if (!read(record_count)) return fail();
+
+    for (std::uint64_t i = 0; i < record_count; ++i) {
+        RecordHeader record;
+        if (!read(record) || std::size_t(end - ptr) < std::size_t(record.plies) * ply_size) {
+            return fail();
+        }
+
+        const char *plies = ptr;
+        ptr += std::size_t(record.plies) * ply_size;
+
+        // archives have no headers, their fingerprints are of the whole record instead
+        if (game_set.enabled()) {
+            const auto string = [&](std::uint32_t index) {
+                return index == no_string ? std::string_view() : strings.at(index);
+            };
+
+            FingerprintHasher hasher;
+            hasher.add(string(record.fen));
+            hasher.add(string(record.white));
+            hasher.add(string(record.black));
+            hasher.add(std::string_view(reinterpret_cast<const char *>(&record.result), 1));
+            hasher.add(std::string_view(plies, std::size_t(record.plies) * ply_size));
+
+            if (!game_set.insert(hasher.finish())) {
+                continue;
+            }
+        }
+
+        total_games++;
+
+        bool do_filter    = filter;
+        Color filter_side = Color::NONE;
+
+        if (do_filter) {
+            if (record.white != no_string && record.black != no_string) {
+                if (matches(record.white)) {
+                    filter_side = Color::WHITE;
+                }
+
+                if (matches(record.black)) {
+                    if (filter_side == Color::NONE) {
+                        filter_side = Color::BLACK;
+                    } else {
+                        do_filter = false;
+                    }
+                }
+            }
+        }
+
+        const auto &position = position_info(record.fen);
+        const auto white     = static_cast<Result>(record.result);
+        const auto black     = white == Result::WIN    ? Result::LOSS
+                               : white == Result::LOSS ? Result::WIN
+                                                       : Result::DRAW;
+
+        Color stm = position.stm;
+
+        for (std::uint16_t ply = 0; ply < record.plies; ++ply, stm = ~stm) {
+            // same wrap around as the plies counter of the board
+            const std::uint16_t board_plies = position.plies + ply;
+            const int move_number           = 1 + board_plies / 2;
+
+            if (move_number > 200) {
+                break;
+            }
+
+            std::int16_t eval;
+            std::memcpy(&eval, plies + ply * ply_size + 1, sizeof(eval));
+
+            if (eval == analysis::no_eval || (do_filter && filter_side != stm)) {
+                continue;
+            }
+
+            Key key;
+            key.result   = stm == Color::WHITE ? white : black;
+            key.move     = move_number;
+            key.material = static_cast<std::uint8_t>(plies[ply * ply_size]);
+            key.eval     = eval;
+
+            const PackedKey packed(key);
+
+            local_map->lazy_emplace_l(
+                packed, [&](map_t::value_type &v) { v.second += 1; },
+                [&](const map_t::constructor &ctor) {
+                    ctor(packed, 1);
+                    new_keys++;
+                });
+        }
+
+        spill_within_file();
+    }
+}
+
+void scan(const std::string &file, const std::string &regex_engine, const map_fens &fixfen_map) {
+    std::ifstream in(file, std::ios::binary | std::ios::ate);
+    const auto size = in.is_open() ? std::streamoff(in.tellg()) : -1;
+
+    std::string data;
+
+    // e.g. the file was removed after the directory was listed
+    if (size >= 0) {
+        data.resize(size);
+        in.seekg(0);
+        in.read(data.data(), data.size());
+    }
+
+    if (size < 0 || !in) {
+        std::cerr << "Error while scanning: " << file << ". Error: Could not read" << std::endl;
+        return;
+    }
+
+    scan(data, file, regex_engine, fixfen_map);
+}
+
+/// @brief Name of the archive for a pgn file, e.g. foo.pgn.gz becomes foo.wdlbin
+/// @param file
+/// @return
+[[nodiscard]] std::string archive_name(const std::string &file) {
+    const auto pos = file.rfind(".pgn");
+    return (pos == std::string::npos ? file : file.substr(0, pos)) + extension;
+}
+
+}  // namespace archive
+
+/// @brief The visitor of the current worker thread, created once and reused for all the sources
+/// it analyses on any path, such that its regex, board and buffers stay warm.
+/// @param regex_engine
+/// @param fixfen_map the same for all sources of a thread, with --numa the map of its node
+/// @param make_visitor
+/// @return
+[[nodiscard]] FileVisitor &worker_visitor(const std::string &regex_engine,
+                                          const map_fens &fixfen_map,
+                                          AnalyzeFactory make_visitor) {
+    thread_local std::unique_ptr<FileVisitor> visitor;
+    thread_local AnalyzeFactory factory = nullptr;
+    thread_local const map_fens *fixfen = nullptr;
+
+    if (!visitor || factory != make_visitor || fixfen != &fixfen_map) {
+        visitor = make_visitor(regex_engine, fixfen_map);
+        factory = make_visitor;
+        fixfen  = &fixfen_map;
+    }
+
+    return *visitor;
+}
+
+void ana_files(const std::vector<PgnSource> &sources, const std::string &regex_engine,
+               const map_fens &fixfen_map, AnalyzeFactory make_visitor) {
+    auto &vis = worker_visitor(regex_engine, fixfen_map, make_visitor);
+
+    for (const auto &source : sources) {
+        const auto &file = source.file;
+
+        checkpoint.enter();
+
+        if (ends_with(file, archive::extension)) {
+            archive::scan(file, regex_engine, fixfen_map);
+        } else {
+            vis.set_file(file);
+            read_pgn(source, vis);
+        }
+
+        san_cache.flush_stats();
+
+        checkpoint.leave(source.id());
+
+        spill_if_full();
+    }
+}
+
+/// @brief Analyse a source that was read into memory, e.g. from a stream or by read-ahead.
+/// @param name file name, its extension gives the format of data
+/// @param id id of the source for checkpoints
+/// @param data
+/// @param regex_engine
+/// @param fixfen_map
+/// @param make_visitor
+void ana_data(const std::string &name, const std::string &id, std::string_view data,
+              const std::string &regex_engine, const map_fens &fixfen_map,
+              AnalyzeFactory make_visitor) {
+    checkpoint.enter();
+
+    if (ends_with(name, archive::extension)) {
+        archive::scan(data, name, regex_engine, fixfen_map);
+    } else {
+        auto &vis = worker_visitor(regex_engine, fixfen_map, make_visitor);
+        vis.set_file(name);
+
+        tar::membuf buffer(data);
+
+        if (ends_with(name, ".gz")) {
+            tar::gzbuf gz(&buffer);
+            std::istream iss(&gz);
+            parse_pgn(iss, name, vis);
+#ifdef USE_ZSTD
+        } else if (ends_with(name, ".zst")) {
+            zstd::zstdstreambuf zst(&buffer);
+            std::istream iss(&zst);
+            parse_pgn(iss, name, vis);
+#endif
+        } else {
+            std::istream iss(&buffer);
+            parse_pgn(iss, name, vis);
+        }
+    }
+
+    san_cache.flush_stats();
+
+    checkpoint.leave(id);
+
+    spill_if_full();
+}
+
+/// @brief Uncompressed size of the parts seekable .pgn.zst files are split into
+static constexpr std::uint64_t zstd_split_size = 16 << 20;
+
+/// @brief Turn the files into sources for processing, splitting game aligned seekable .pgn.zst
+/// files into ranges of frames, such that a single large file is processed in parallel.
+/// @param files
+/// @return
+[[nodiscard]] std::vector<PgnSource> make_sources(const std::vector<std::string> &files) {
+    std::vector<PgnSource> sources;
+
+    for (const auto &file : files) {
+        if (!ends_with(file, ".zst")) {
+            sources.push_back({file});
+            continue;
+        }
+
+#ifdef USE_ZSTD
+        const auto frames = zstd::read_game_aligned_frames(file);
+
+        if (frames.size() < 2) {
+            sources.push_back({file});
+            continue;
+        }
+
+        std::uint64_t begin = 0, size = 0;
+
+        for (const auto &frame : frames) {
+            size += frame.decompressed;
+
+            if (size >= zstd_split_size) {
+                sources.push_back({file, begin, frame.offset + frame.compressed});
+                begin = frame.offset + frame.compressed;
+                size  = 0;
+            }
+        }
+
+        // the remaining frames, including the seek table which is skipped when decompressing
+        if (begin == 0) {
+            sources.push_back({file});
+        } else if (size > 0) {
+            sources.push_back({file, begin, frames.back().offset + frames.back().compressed});
+        }
+#else
+        std::cout << "Error: " << file << " needs zstd support, rebuild with libzstd present."
+                  << std::endl;
+        std::exit(1);
+#endif
+    }
+
+    return sources;
+}
+
+}  // namespace analysis
+
+[[nodiscard]] map_fens get_fixfen(std::string file) {
+    map_fens fixfen_map;
+    if (file.empty()) {
+        return fixfen_map;
+    }
+
+    const auto fen_iterator = [&](std::istream &iss) {
+        std::string line;
+        while (std::getline(iss, line)) {
+            std::istringstream iss(line);
+            std::string f1, f2, f3, ep;
+            int halfmove, fullmove = 0;
+
+            iss >> f1 >> f2 >> f3 >> ep >> halfmove >> fullmove;
+
+            if (!fullmove) continue;
+
+            auto key         = f1 + ' ' + f2 + ' ' + f3 + ' ' + ep;
+            auto fixfen_data = std::pair<int, int>(halfmove, fullmove);
+
+            if (fixfen_map.find(key) != fixfen_map.end()) {
+                // for duplicate FENs, prefer the one with lower full move counter
+                if (fullmove < fixfen_map[key].second) {
+                    fixfen_map[key] = fixfen_data;
+                }
+            } else {
+                fixfen_map[key] = fixfen_data;
+            }
+        }
+    };
+
+    if (ends_with(file, ".gz")) {
+        igzstream input(file.c_str());
+        fen_iterator(input);
+    } else {
+        std::ifstream input(file);
+        fen_iterator(input);
+    }
+
+    return fixfen_map;
+}
+
+/// @brief The test of a pgn or json file, i.e. its path up to the test id, e.g. "pgns/abc" for
+/// "pgns/abc-0.pgn.gz" and "pgns/abc.json".
+/// @param pathname
+/// @return
+[[nodiscard]] std::string get_test_filename(const std::string &pathname) {
+    fs::path path(pathname);
+    std::string filename = path.filename().string();
+    std::string test_id  = filename.substr(0, filename.find_first_of("-."));
+    return (path.parent_path() / test_id).string();
+}
+
+[[nodiscard]] map_meta get_metadata(const std::vector<std::string> &file_list,
+                                    bool allow_duplicates) {
+    map_meta meta_map;
+    // map to check for duplicate tests
+    std::unordered_map<std::string, std::string> test_map;
+    std::set<std::string> test_warned;
+
+    for (const auto &pathname : file_list) {
+        fs::path path(pathname);
+        std::string filename      = path.filename().string();
+        std::string test_id       = filename.substr(0, filename.find_first_of("-."));
+        std::string test_filename = get_test_filename(pathname);
+
+        if (test_map.find(test_id) == test_map.end()) {
+            test_map[test_id] = test_filename;
+        } else if (test_map[test_id] != test_filename) {
+            if (test_warned.find(test_filename) == test_warned.end()) {
+                std::cout << (allow_duplicates ? "Warning" : "Error")
+                          << ": Detected a duplicate of test " << test_id << " in directory "
+                          << path.parent_path().string() << std::endl;
+                test_warned.insert(test_filename);
+
+                if (!allow_duplicates) {
+                    std::cout << "Use --allowDuplicates to continue nonetheless." << std::endl;
+                    std::exit(1);
+                }
+            }
+        }
+
+        // load the JSON data from disk, only once for each test
+        if (meta_map.find(test_filename) == meta_map.end()) {
+            std::ifstream json_file(test_filename + ".json");
+
+            if (!json_file.is_open()) continue;
+
+            json metadata = json::parse(json_file);
+
+            meta_map[test_filename] = metadata.get<TestMetaData>();
+        }
+    }
+
+    return meta_map;
+}
+
+/// @brief A filter strategy, returns true for the tests to skip, given their test filename.
+using FileFilter = std::function<bool(const std::string &, const map_meta &)>;
+
+template <typename STRATEGY>
+[[nodiscard]] FileFilter make_filter(STRATEGY strategy) {
+    return [strategy = std::move(strategy)](const std::string &test_filename,
+                                            const map_meta &meta_map) {
+        return strategy.apply(test_filename, meta_map);
+    };
+}
+
+/// @brief Whether any of the filters skips the test.
+[[nodiscard]] bool is_filtered(const std::vector<FileFilter> &filters,
+                               const std::string &test_filename, const map_meta &meta_map) {
+    return std::any_of(filters.begin(), filters.end(),
+                       [&](const FileFilter &filter) { return filter(test_filename, meta_map); });
+}
+
+void filter_files(std::vector<std::string> &file_list, const map_meta &meta_map,
+                  const std::vector<FileFilter> &filters) {
+    const auto applier = [&](const std::string &pathname) {
+        return is_filtered(filters, get_test_filename(pathname), meta_map);
+    };
+    const auto it = std::remove_if(file_list.begin(), file_list.end(), applier);
+    file_list.erase(it, file_list.end());
+}
+
+class BookFilterStrategy {
+    std::regex regex_book;
+    bool invert;
+
+   public:
+    BookFilterStrategy(const std::regex &rb, bool inv) : regex_book(rb), invert(inv) {}
+
+    bool apply(const std::string &filename, const map_meta &meta_map) const {
+        // check if metadata and "book" entry exist
+        if (meta_map.find(filename) != meta_map.end() && meta_map.at(filename).book.has_value()) {
+            bool match = std::regex_match(meta_map.at(filename).book.value(), regex_book);
+            return invert ? match : !match;
+        }
+
+        // missing metadata or "book" entry can never match
+        return true;
+    }
+};
+
+class RevFilterStrategy {
+    std::regex regex_rev;
+
+   public:
+    RevFilterStrategy(const std::regex &rb) : regex_rev(rb) {}
+
+    bool apply(const std::string &filename, const map_meta &meta_map) const {
+        if (meta_map.find(filename) == meta_map.end()) {
+            return true;
+        }
+
+        if (meta_map.at(filename).resolved_base.has_value() &&
+            std::regex_match(meta_map.at(filename).resolved_base.value(), regex_rev)) {
+            return false;
+        }
+
+        if (meta_map.at(filename).resolved_new.has_value() &&
+            std::regex_match(meta_map.at(filename).resolved_new.value(), regex_rev)) {
+            return false;
+        }
+
+        return true;
+    }
+};
+
+class TcFilterStrategy {
+    std::regex regex_tc;
+
+   public:
+    TcFilterStrategy(const std::regex &rb) : regex_tc(rb) {}
+
+    bool apply(const std::string &filename, const map_meta &meta_map) const {
+        if (meta_map.find(filename) == meta_map.end()) {
+            return true;
+        }
+
+        if (meta_map.at(filename).new_tc.has_value() && meta_map.at(filename).tc.has_value()) {
+            if (meta_map.at(filename).new_tc.value() != meta_map.at(filename).tc.value()) {
+                return true;
+            }
+
+            if (std::regex_match(meta_map.at(filename).tc.value(), regex_tc)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+};
+
+class ThreadsFilterStrategy {
+    int threads;
+
+   public:
+    ThreadsFilterStrategy(int t) : threads(t) {}
+
+    bool apply(const std::string &filename, const map_meta &meta_map) const {
+        if (meta_map.find(filename) == meta_map.end()) {
+            return true;
+        }
+
+        if (meta_map.at(filename).threads.has_value() &&
+            meta_map.at(filename).threads.value() == threads) {
+            return false;
+        }
+
+        return true;
+    }
+};
+
+class EloFilterStrategy {
+    double EloDiffMin, EloDiffMax;
+
+   public:
+    EloFilterStrategy(double mi, double ma) : EloDiffMin(mi), EloDiffMax(ma) {}
+
+    double pentanomialToEloDiff(const std::vector<int> &pentanomial) const {
+        auto pairs            = std::accumulate(pentanomial.begin(), pentanomial.end(), 0);
+        const double WW       = double(pentanomial[4]) / pairs;
+        const double WD       = double(pentanomial[3]) / pairs;
+        const double WLDD     = double(pentanomial[2]) / pairs;
+        const double LD       = double(pentanomial[1]) / pairs;
+        const double LL       = double(pentanomial[0]) / pairs;
+        const double score    = WW + 0.75 * WD + 0.5 * WLDD + 0.25 * LD;
+        const double WW_dev   = WW * std::pow((1 - score), 2);
+        const double WD_dev   = WD * std::pow((0.75 - score), 2);
+        const double WLDD_dev = WLDD * std::pow((0.5 - score), 2);
+        const double LD_dev   = LD * std::pow((0.25 - score), 2);
+        const double LL_dev   = LL * std::pow((0 - score), 2);
+        const double variance = WW_dev + WD_dev + WLDD_dev + LD_dev + LL_dev;
+        return (score - 0.5) / std::sqrt(2 * variance) * (800 / std::log(10));
+    }
+
+    bool apply(const std::string &filename, const map_meta &meta_map) const {
+        if (meta_map.find(filename) == meta_map.end()) {
+            return true;
+        }
+
+        if (!meta_map.at(filename).pentanomial.has_value()) {
+            return true;
+        }
+
+        double fileEloDiff = pentanomialToEloDiff(meta_map.at(filename).pentanomial.value());
+        if (EloDiffMin <= fileEloDiff && fileEloDiff <= EloDiffMax) {
+            return false;
+        }
+
+        return true;
+    }
+};
+
+class SprtFilterStrategy {
+   public:
+    bool apply(const std::string &filename, const map_meta &meta_map) const {
+        // check if metadata and "sprt" entry exist
+        if (meta_map.find(filename) != meta_map.end() && meta_map.at(filename).sprt.has_value() &&
+            meta_map.at(filename).sprt.value()) {
+            return false;
+        }
+
+        return true;
+    }
+};
+
+/// @brief Merge the node maps into pos_map.
+void merge_node_maps() {
+    for (auto &map : node_maps) {
+        for (const auto &[key, count] : *map) {
+            pos_map.lazy_emplace_l(
+                key, [&](map_t::value_type &v) { v.second += count; },
+                [&](const map_t::constructor &ctor) { ctor(key, count); });
+        }
+
+        map.reset();
+    }
+
+    node_maps.clear();
 }
 
-template <typename STRATEGY>
-void filter_files(std::vector<std::string> &file_list, const map_meta &meta_map,
-                  const STRATEGY &strategy) {
-    const auto applier = [&](const std::string &pathname) {
-        fs::path path(pathname);
-        std::string filename      = path.filename().string();
-        std::string test_id       = filename.substr(0, filename.find_first_of("-."));
-        std::string test_filename = (path.parent_path() / test_id).string();
-        return strategy.apply(test_filename, meta_map);
+/// @brief How a run uses the memory given by --maxMemory.
+struct MemoryPlan {
+    int concurrency;
+    std::uint64_t buffers;  // for the files read ahead or the sources of a stream
+    std::size_t map_slots;  // of pos_map, in total over its submaps
+};
+
+/// @brief Memory of a worker: its parser, SAN cache and decompression stream, whose zstd window
+/// is at most 8 MiB for the frames written by pgn2zst.
+static constexpr std::uint64_t worker_memory = 8 << 20;
+
+/// @brief Plan the memory of a run within budget. What is resident now, e.g. the metadata,
+/// fixfen_map and the fingerprints of --dedupFile or a checkpoint, stays. The fingerprints that
+/// --dedup adds during the run are not planned for. Half of the rest goes to the map, and the
+/// other half to the workers, up to a quarter, and the buffers. When saving, after the workers and
+/// buffers are gone, that half holds the binned output.
+/// @param budget in bytes
+/// @param concurrency the number of workers asked for
+/// @return
+[[nodiscard]] MemoryPlan plan_memory(std::uint64_t budget, int concurrency) {
+    const auto resident = process_memory("VmRSS");
+
+    if (resident + 4 * worker_memory > budget) {
+        std::cout << "Error: --maxMemory of " << (budget >> 20) << " MiB is too small, "
+                  << (resident >> 20) << " MiB are in use and " << (4 * worker_memory >> 20)
+                  << " MiB more are needed." << std::endl;
+        std::exit(1);
+    }
+
+    const auto available = budget - resident;
+
+    MemoryPlan plan;
+    plan.concurrency = int(std::clamp<std::uint64_t>(available / 4 / worker_memory, 1,
+                                                     std::max(1, concurrency)));
+    plan.buffers     = available / 2 - plan.concurrency * worker_memory;
+
+    // the submaps have 2^k - 1 slots, each taking a value and a control byte
+    const std::uint64_t submap_bytes = map_t::subcnt() * (sizeof(map_t::value_type) + 1);
+    std::uint64_t capacity           = 1023;
+
+    while ((2 * capacity + 2) * submap_bytes <= available / 2) {
+        capacity = 2 * capacity + 1;
+    }
+
+    plan.map_slots = capacity * map_t::subcnt();
+
+    return plan;
+}
+
+void process(const std::vector<PgnSource> &sources, const std::string &regex_engine,
+             const map_fens &fixfen_map, int concurrency, bool numa_aware) {
+    // Create more chunks than threads to prevent threads from idling.
+    int target_chunks = 4 * concurrency;
+
+    auto files_chunked = split_chunks(sources, target_chunks);
+
+    std::cout << "Found " << sources.size() << " .pgn(.gz|.zst) sources, creating "
+              << files_chunked.size() << " chunks for processing." << std::endl;
+
+    // Mutex for progress success
+    std::mutex progress_mutex;
+
+    // the options do not change during the run, the workers use the visitor specialized for them
+    const auto make_visitor = analysis::select_analyze(regex_engine, fixfen_map);
+
+    // Create a thread pool
+    ThreadPool pool(concurrency);
+
+    const auto chunk_done = [&]() {
+        total_chunks++;
+
+        // Limit the scope of the lock
+        {
+            const std::lock_guard<std::mutex> lock(progress_mutex);
+
+            // Print progress
+            std::cout << "\rProgress: " << total_chunks << "/" << files_chunked.size()
+                      << std::flush;
+        }
     };
-    const auto it = std::remove_if(file_list.begin(), file_list.end(), applier);
-    file_list.erase(it, file_list.end());
+
+    // Workers are spread round-robin over the NUMA nodes and pinned to their cores. Each node
+    // counts into its own map and reads its own copy of fixfen_map, both allocated by the first
+    // worker of the node so that the pages are local to it. Streams and buffers are local
+    // anyway, as each worker allocates them itself.
+    const auto nodes = numa_aware ? numa::node_cpus() : std::vector<std::vector<int>>{};
+    std::vector<map_fens> node_fixfen(nodes.size());
+    std::vector<std::once_flag> node_init(nodes.size());
+
+    for (std::size_t i = 0; i < nodes.size(); ++i) {
+        node_maps.push_back(std::make_unique<map_t>());
+    }
+
+    if (numa_aware) {
+        std::cout << "Pinning " << concurrency << " threads to the cores of " << nodes.size()
+                  << " NUMA node" << (nodes.size() > 1 ? "s." : ".") << std::endl;
+    }
+
+    // Print progress
+    std::cout << "\rProgress: " << total_chunks << "/" << files_chunked.size() << std::flush;
+
+    checkpoint.start();
+
+    if (numa_aware) {
+        // the workers take the chunks from a shared counter, no node waits for another
+        std::atomic<std::size_t> next_chunk = 0;
+
+        for (int worker = 0; worker < concurrency; ++worker) {
+            const std::size_t node = worker % nodes.size();
+            const std::size_t core = worker / nodes.size();
+            const auto &cpus       = nodes[node];
+            const int cpu          = cpus.empty() ? -1 : cpus[core % cpus.size()];
+
+            pool.enqueue([&, node, cpu]() {
+                numa::pin(cpu);
+
+                std::call_once(node_init[node], [&]() {
+                    // the checkpoint writer must not see the map while it is being allocated
+                    checkpoint.enter();
+                    node_maps[node]->reserve(analysis::map_size / nodes.size());
+                    checkpoint.leave();
+
+                    node_fixfen[node] = fixfen_map;
+                });
+
+                local_map = node_maps[node].get();
+
+                for (std::size_t i; (i = next_chunk++) < files_chunked.size();) {
+                    analysis::ana_files(files_chunked[i], regex_engine, node_fixfen[node],
+                                        make_visitor);
+                    chunk_done();
+                }
+
+                local_map = &pos_map;
+            });
+        }
+    } else {
+        for (const auto &files : files_chunked) {
+            pool.enqueue([&files, &regex_engine, &fixfen_map, &chunk_done, make_visitor]() {
+                analysis::ana_files(files, regex_engine, fixfen_map, make_visitor);
+                chunk_done();
+            });
+        }
+    }
+
+    // Wait for all threads to finish
+    pool.wait();
+
+    checkpoint.stop();
+
+    merge_node_maps();
 }
 
-class BookFilterStrategy {
-    std::regex regex_book;
-    bool invert;
+/// @brief Analyse the sources with read-ahead: this thread reads the upcoming sources
+/// asynchronously, up to depth at a time and within memory bytes of buffers, and the pool parses
+/// the sources that have been read, such that parsing does not wait on the disk while sources are
+/// buffered. Sources larger than the whole budget are read by a worker as usual.
+/// @param sources
+/// @param regex_engine
+/// @param fixfen_map
+/// @param concurrency
+/// @param depth
+/// @param memory
+void process_readahead(const std::vector<PgnSource> &sources, const std::string &regex_engine,
+                       const map_fens &fixfen_map, int concurrency, unsigned depth,
+                       std::uint64_t memory) {
+    read_ahead::Reader reader(depth);
+
+    std::cout << "Found " << sources.size() << " .pgn(.gz|.zst) sources, reading up to " << depth
+              << " ahead in " << (memory >> 20) << " MiB with " << reader.backend() << "."
+              << std::endl;
+
+    std::mutex progress_mutex;
+    std::condition_variable progress_condition;
+    std::uint64_t buffered = 0;
+
+    const auto chunk_done = [&](std::uint64_t size) {
+        total_chunks++;
+
+        {
+            const std::lock_guard<std::mutex> lock(progress_mutex);
+            buffered -= size;
+
+            std::cout << "\rProgress: " << total_chunks << "/" << sources.size() << std::flush;
+        }
+
+        progress_condition.notify_all();
+    };
+
+    const auto size_of = [](const PgnSource &source) -> std::uint64_t {
+        std::error_code ec;
+        return source.end ? source.end - source.begin : fs::file_size(source.file, ec);
+    };
+
+    // the buffer memory taken by each source
+    std::vector<std::uint64_t> reserved(sources.size(), 0);
+
+    const auto make_visitor = analysis::select_analyze(regex_engine, fixfen_map);
+
+    ThreadPool pool(concurrency);
+
+    std::cout << "\rProgress: " << total_chunks << "/" << sources.size() << std::flush;
+
+    checkpoint.start();
+
+    std::size_t next = 0;
+
+    while (next < sources.size() || reader.in_flight() > 0) {
+        // start reads as long as depth and memory allow
+        while (next < sources.size() && reader.in_flight() < depth) {
+            const auto &source = sources[next];
+            const auto size    = size_of(source);
+
+            if (size > memory) {
+                pool.enqueue([&source, &regex_engine, &fixfen_map, &chunk_done, make_visitor]() {
+                    analysis::ana_files({source}, regex_engine, fixfen_map, make_visitor);
+                    chunk_done(0);
+                });
+
+                next++;
+                continue;
+            }
+
+            {
+                std::unique_lock<std::mutex> lock(progress_mutex);
+
+                // without reads in flight, wait for the workers to release buffers
+                if (reader.in_flight() == 0) {
+                    progress_condition.wait(lock, [&] { return buffered + size <= memory; });
+                } else if (buffered + size > memory) {
+                    break;
+                }
+
+                buffered += size;
+            }
+
+            reserved[next] = size;
+
+            auto request    = std::make_unique<read_ahead::Request>();
+            request->id     = next++;
+            request->file   = source.file;
+            request->offset = source.begin;
+            request->size   = size;
+
+            reader.submit(std::move(request));
+        }
+
+        auto request = reader.wait();
+
+        if (!request) {
+            continue;
+        }
+
+        const std::size_t source_index = request->id;
+
+        pool.enqueue([&, source_index,
+                      request = std::shared_ptr<read_ahead::Request>(std::move(request))]() mutable {
+            const auto &source = sources[source_index];
+
+            if (request->ok) {
+                analysis::ana_data(source.file, source.id(),
+                                   std::string_view(request->data.get(), request->size),
+                                   regex_engine, fixfen_map, make_visitor);
+            } else {
+                std::cerr << "Error: Could not read " << source.file << std::endl;
+            }
+
+            request.reset();
+            chunk_done(reserved[source_index]);
+        });
+    }
+
+    pool.wait();
+
+    checkpoint.stop();
+}
+
+/// @brief Whether --file is read as a stream, i.e. stdin or a tar archive.
+[[nodiscard]] bool is_stream(const std::string &file) {
+    return file == "-" || ends_with(file, ".tar") || ends_with(file, ".tar.gz") ||
+           ends_with(file, ".tgz");
+}
+
+/// @brief Analyse the pgns of a stream without unpacking it to disk: stdin or a file holding a
+/// pgn or a tar archive of .pgn(.gz) and .json files, each possibly gzipped. This thread reads
+/// and decompresses the stream, the pool decompresses and parses the pgns. A pgn stream is split
+/// into chunks of complete games. With filters, the pgns of a test are held until its metadata
+/// arrives, in memory within the bound or else in a temporary file, and tests without metadata
+/// are filtered at the end of the archive.
+/// @param name
+/// @param filters
+/// @param regex_engine
+/// @param fixfen_map
+/// @param concurrency
+/// @param memory bound of the sources held, waiting for and analysed by the pool, a larger source
+/// is analysed alone
+void process_stream(const std::string &name, const std::vector<FileFilter> &filters,
+                    const std::string &regex_engine, const map_fens &fixfen_map, int concurrency,
+                    std::uint64_t memory) {
+    // uncompressed size of the chunks of a pgn stream, fixed as it determines their checkpoint ids
+    constexpr std::size_t chunk_size = 4 << 20;
+
+    // the pgns held for their metadata without a bound on the memory
+    constexpr std::uint64_t max_held = 1ull << 30;
+
+    struct Source {
+        std::string id;
+        std::string data;
+
+        // the data in the spool file, when held for the metadata beyond the memory bound
+        std::uint64_t spool_offset = 0, spool_size = 0;
+    };
+
+    std::ifstream file;
+    std::streambuf *source = std::cin.rdbuf();
+
+    if (name != "-") {
+        file.open(name, std::ios::binary);
+
+        if (!file.is_open()) {
+            std::cerr << "Error: Could not open " << name << std::endl;
+            std::exit(1);
+        }
+
+        source = file.rdbuf();
+    }
+
+    // detect gzip by its magic number and a tar archive by its first header
+    std::unique_ptr<tar::gzbuf> gz;
+
+    if (source->sgetc() == 0x1f) {
+        gz     = std::make_unique<tar::gzbuf>(source);
+        source = gz.get();
+    }
+
+    std::string head(tar::block_size, '\0');
+    head.resize(std::max<std::streamsize>(0, source->sgetn(head.data(), head.size())));
+
+    const bool is_tar = tar::is_header(head);
+
+    tar::prefixbuf prefixed(std::move(head), source);
+    std::istream input(&prefixed);
+
+    std::cout << "Reading " << (is_tar ? "tar archive" : "pgn") << " from "
+              << (name == "-" ? "stdin" : name) << std::endl;
+
+    std::mutex progress_mutex;
+    std::condition_variable progress_condition;
+    std::size_t in_flight = 0, filtered = 0;
+    std::uint64_t buffered = 0;
+
+    // bound the memory of the sources waiting for a thread
+    const std::size_t max_in_flight = 2 * concurrency;
+
+    const auto make_visitor = analysis::select_analyze(regex_engine, fixfen_map);
+
+    const auto print_progress = [&]() {
+        std::cout << "\rProgress: " << total_chunks << " sources, " << filtered << " filtered"
+                  << std::flush;
+    };
+
+    ThreadPool pool(concurrency);
+
+    checkpoint.start();
+
+    const auto enqueue = [&](Source &&work) {
+        const auto size = work.data.size();
+
+        {
+            std::unique_lock<std::mutex> lock(progress_mutex);
+            progress_condition.wait(lock, [&] {
+                return in_flight == 0 || (in_flight < max_in_flight && buffered + size <= memory);
+            });
+            in_flight++;
+            buffered += size;
+        }
+
+        pool.enqueue([&, size, work = std::move(work)]() {
+            // the id ends with the name of the member, or with the number of a pgn chunk
+            analysis::ana_data(work.id, work.id, work.data, regex_engine, fixfen_map,
+                               make_visitor);
+
+            total_chunks++;
+
+            {
+                const std::lock_guard<std::mutex> lock(progress_mutex);
+                in_flight--;
+                buffered -= size;
+                print_progress();
+            }
+
+            progress_condition.notify_all();
+        });
+    };
+
+    if (is_tar) {
+        map_meta meta_map;
+        std::unordered_map<std::string, std::vector<Source>> pending;
+
+        // held pgns are charged to buffered, spooled ones are read back when released
+        const std::uint64_t held_memory = std::min(memory, max_held);
+        std::unique_ptr<std::FILE, int (*)(std::FILE *)> spool(nullptr, std::fclose);
+        std::uint64_t spool_end = 0;
+
+        const auto hold = [&](const std::string &test_filename, Source &&work) {
+            {
+                const std::lock_guard<std::mutex> lock(progress_mutex);
+
+                if (buffered + work.data.size() <= held_memory) {
+                    buffered += work.data.size();
+                    pending[test_filename].push_back(std::move(work));
+                    return;
+                }
+            }
+
+            if (!spool) {
+                spool.reset(std::tmpfile());
+            }
+
+            if (!spool || std::fseek(spool.get(), spool_end, SEEK_SET) != 0 ||
+                std::fwrite(work.data.data(), 1, work.data.size(), spool.get()) !=
+                    work.data.size()) {
+                std::cerr << "Error: Could not spool " << work.id
+                          << " to a temporary file while waiting for the metadata of its test, "
+                             "put the .json files first in the tar."
+                          << std::endl;
+                std::exit(1);
+            }
+
+            work.spool_offset = spool_end;
+            work.spool_size   = work.data.size();
+            spool_end += work.spool_size;
+
+            work.data.clear();
+            work.data.shrink_to_fit();
+
+            pending[test_filename].push_back(std::move(work));
+        };
+
+        const auto release = [&](Source &work, bool filtered_out) {
+            if (work.spool_size == 0) {
+                const std::lock_guard<std::mutex> lock(progress_mutex);
+                buffered -= work.data.size();
+                return;
+            }
+
+            if (filtered_out) return;
+
+            work.data.resize(work.spool_size);
+
+            if (std::fseek(spool.get(), work.spool_offset, SEEK_SET) != 0 ||
+                std::fread(work.data.data(), 1, work.data.size(), spool.get()) !=
+                    work.data.size()) {
+                std::cerr << "Error: Could not read " << work.id << " back from its temporary file."
+                          << std::endl;
+                std::exit(1);
+            }
+        };
+
+        const auto enqueue_unfiltered = [&](const std::string &test_filename, Source &&work) {
+            if (is_filtered(filters, test_filename, meta_map)) {
+                const std::lock_guard<std::mutex> lock(progress_mutex);
+                filtered++;
+                print_progress();
+                return;
+            }
+
+            enqueue(std::move(work));
+        };
+
+        const auto enqueue_pending = [&](const std::string &test_filename,
+                                         std::vector<Source> &works) {
+            const bool filtered_out = is_filtered(filters, test_filename, meta_map);
+
+            for (auto &work : works) {
+                release(work, filtered_out);
+                enqueue_unfiltered(test_filename, std::move(work));
+            }
+        };
+
+        tar::Reader reader(input);
+        tar::Reader::Member member;
+
+        while (reader.next(member)) {
+            const auto test_filename = get_test_filename(member.name);
+
+            if (ends_with(member.name, ".json")) {
+                if (filters.empty()) continue;
+
+                std::string data;
+                if (!reader.read(data)) break;
+
+                meta_map[test_filename] = json::parse(data).get<TestMetaData>();
+
+                // release the pgns of the test that came before its metadata
+                const auto it = pending.find(test_filename);
+
+                if (it != pending.end()) {
+                    enqueue_pending(test_filename, it->second);
+                    pending.erase(it);
+                }
+
+                continue;
+            }
+
+            if (!ends_with(member.name, ".pgn.gz") && !ends_with(member.name, ".pgn")) continue;
+
+            Source work{name + ":" + member.name, {}};
+
+            if (checkpoint.is_completed(work.id)) continue;
+
+            if (!reader.read(work.data)) break;
+
+            if (filters.empty() || meta_map.find(test_filename) != meta_map.end()) {
+                enqueue_unfiltered(test_filename, std::move(work));
+            } else {
+                hold(test_filename, std::move(work));
+            }
+        }
+
+        // tests without metadata, the filters skip them like tests without .json files on disk
+        for (auto &[test_filename, works] : pending) {
+            enqueue_pending(test_filename, works);
+        }
+    } else {
+        // a header after movetext starts a new game, the only place where a chunk may end
+        std::string line, chunk;
+        bool in_moves      = false;
+        std::size_t chunks = 0;
+
+        // room for the game that completes a chunk, such that the chunk is not reallocated
+        chunk.reserve(chunk_size + (chunk_size >> 2));
+
+        const auto enqueue_chunk = [&]() {
+            Source work{name + ":" + std::to_string(chunks++), std::move(chunk)};
+            chunk.clear();
+            chunk.reserve(chunk_size + (chunk_size >> 2));
+
+            if (!checkpoint.is_completed(work.id)) {
+                enqueue(std::move(work));
+            }
+        };
+
+        while (std::getline(input, line)) {
+            const bool is_header = !line.empty() && line[0] == '[';
+
+            if (is_header && in_moves) {
+                in_moves = false;
+
+                if (chunk.size() >= chunk_size) {
+                    enqueue_chunk();
+                }
+            } else if (!is_header && !line.empty()) {
+                in_moves = true;
+            }
+
+            chunk += line;
+            chunk += '\n';
+        }
+
+        if (!chunk.empty()) {
+            enqueue_chunk();
+        }
+    }
+
+    pool.wait();
+
+    checkpoint.stop();
+}
+
+/// @brief Convert the pgn files into binary game archives in archive_dir, keeping the directory
+/// structure below root and copying the test metadata along for filtering.
+/// @param files_pgn
+/// @param root
+/// @param archive_dir
+/// @param concurrency
+void archive_files(const std::vector<std::string> &files_pgn, const std::string &root,
+                   const std::string &archive_dir, int concurrency) {
+    std::atomic<std::size_t> archived_files = 0;
+    std::mutex progress_mutex;
+    std::set<std::string> copied_metadata;
+
+    ThreadPool pool(concurrency);
+
+    for (const auto &file : files_pgn) {
+        pool.enqueue([&, file]() {
+            const fs::path path(file);
+            const fs::path relative = root.empty() ? path.filename() : fs::relative(path, root);
+            const fs::path output   = fs::path(archive_dir) / relative;
+
+            if (!ends_with(file, analysis::archive::extension)) {
+                analysis::archive::Archiver vis(file);
+                analysis::read_pgn({file}, vis);
+
+                fs::create_directories(output.parent_path());
+
+                if (vis.save(analysis::archive::archive_name(output.string()))) {
+                    total_games += vis.games();
+                }
+
+                analysis::san_cache.flush_stats();
+            }
 
-   public:
-    BookFilterStrategy(const std::regex &rb, bool inv) : regex_book(rb), invert(inv) {}
+            std::string filename = path.filename().string();
+            std::string test_id  = filename.substr(0, filename.find_first_of("-."));
+            const auto metadata  = path.parent_path() / (test_id + ".json");
 
-    bool apply(const std::string &filename, const map_meta &meta_map) const {
-        // check if metadata and "book" entry exist
-        if (meta_map.find(filename) != meta_map.end() && meta_map.at(filename).book.has_value()) {
-            bool match = std::regex_match(meta_map.at(filename).book.value(), regex_book);
-            return invert ? match : !match;
-        }
+            const std::lock_guard<std::mutex> lock(progress_mutex);
 
-        // missing metadata or "book" entry can never match
-        return true;
+            if (fs::exists(metadata) && copied_metadata.insert(metadata.string()).second) {
+                fs::copy_file(metadata, output.parent_path() / metadata.filename(),
+                              fs::copy_options::overwrite_existing);
+            }
+
+            std::cout << "\rProgress: " << ++archived_files << "/" << files_pgn.size()
+                      << std::flush;
+        });
     }
-};
 
-class RevFilterStrategy {
-    std::regex regex_rev;
+    pool.wait();
+
+    std::cout << "\nArchived " << total_games << " games from " << archived_files << " files to "
+              << archive_dir << "." << std::endl;
+}
 
+/// @brief Scores a WDL model against the counted positions like the objective functions of
+/// scoreWDL.py, i.e. the log-loss of the outcomes and the error of the expected score, and also
+/// the Brier score of the W/D/L rates, in total and per material count and eval bin. Counting is
+/// at 1cp resolution, so scoring the counts gives the same sums as scoring each position.
+class Calibration {
    public:
-    RevFilterStrategy(const std::regex &rb) : regex_rev(rb) {}
+    Calibration(const WdlModel &model, int eval_bin_width)
+        : model(model), eval_binning(std::to_string(eval_bin_width)) {}
 
-    bool apply(const std::string &filename, const map_meta &meta_map) const {
-        if (meta_map.find(filename) == meta_map.end()) {
-            return true;
-        }
+    void add(PackedKey packed, std::uint64_t count) {
+        const Key key    = packed.unpack();
+        const auto rates = model.rates(key.move, key.material, key.eval);
 
-        if (meta_map.at(filename).resolved_base.has_value() &&
-            std::regex_match(meta_map.at(filename).resolved_base.value(), regex_rev)) {
-            return false;
-        }
+        if (!rates) return;
 
-        if (meta_map.at(filename).resolved_new.has_value() &&
-            std::regex_match(meta_map.at(filename).resolved_new.value(), regex_rev)) {
-            return false;
-        }
+        const int outcome = key.result == Result::WIN ? 0 : key.result == Result::DRAW ? 1 : 2;
 
-        return true;
+        total.add(*rates, outcome, count);
+        by_material[key.material].add(*rates, outcome, count);
+        by_eval[eval_binning(key.eval)].add(*rates, outcome, count);
     }
-};
 
-class TcFilterStrategy {
-    std::regex regex_tc;
+    std::uint64_t positions() const { return total.positions; }
 
-   public:
-    TcFilterStrategy(const std::regex &rb) : regex_tc(rb) {}
+    /// @brief Print the totals and save them with the bins to a json file.
+    /// @param filename
+    void save(const std::string &filename) const {
+        json j = total.to_json();
 
-    bool apply(const std::string &filename, const map_meta &meta_map) const {
-        if (meta_map.find(filename) == meta_map.end()) {
-            return true;
-        }
+        const auto bins = [](const std::map<int, Bin> &map, const char *name) {
+            json array = json::array();
 
-        if (meta_map.at(filename).new_tc.has_value() && meta_map.at(filename).tc.has_value()) {
-            if (meta_map.at(filename).new_tc.value() != meta_map.at(filename).tc.value()) {
-                return true;
+            for (const auto &[value, bin] : map) {
+                array.push_back(bin.to_json());
+                array.back()[name] = value;
             }
 
-            if (std::regex_match(meta_map.at(filename).tc.value(), regex_tc)) {
-                return false;
-            }
-        }
+            return array;
+        };
 
-        return true;
-    }
-};
+        j["material"] = bins(by_material, "material");
+        j["eval"]     = bins(by_eval, "eval");
 
-class ThreadsFilterStrategy {
-    int threads;
+        std::ofstream out_file(filename);
+        out_file << j.dump(2);
+        out_file.close();
 
-   public:
-    ThreadsFilterStrategy(int t) : threads(t) {}
+        std::ostringstream scores;
+        scores << std::fixed << std::setprecision(4) << "log-loss " << j["logLoss"].get<double>()
+               << ", Brier score " << j["brier"].get<double>() << ", score error "
+               << j["scoreError"].get<double>();
 
-    bool apply(const std::string &filename, const map_meta &meta_map) const {
-        if (meta_map.find(filename) == meta_map.end()) {
-            return true;
-        }
+        std::cout << "Model on " << total.positions << " positions: " << scores.str()
+                  << ". Wrote the calibration to " << filename << "." << std::endl;
+    }
 
-        if (meta_map.at(filename).threads.has_value() &&
-            meta_map.at(filename).threads.value() == threads) {
-            return false;
-        }
+   private:
+    struct Bin {
+        std::uint64_t positions = 0;
+        std::array<double, 3> predicted{}, observed{};
+        double log_loss = 0, brier = 0, score_error = 0;
 
-        return true;
-    }
-};
+        void add(const WdlModel::Rates &rates, int outcome, std::uint64_t count) {
+            double squares = 0;
 
-class EloFilterStrategy {
-    double EloDiffMin, EloDiffMax;
+            for (int i = 0; i < 3; ++i) {
+                const double observation = i == outcome;
 
-   public:
-    EloFilterStrategy(double mi, double ma) : EloDiffMin(mi), EloDiffMax(ma) {}
+                predicted[i] += count * rates[i];
+                observed[i] += count * observation;
+                squares += (rates[i] - observation) * (rates[i] - observation);
+            }
 
-    double pentanomialToEloDiff(const std::vector<int> &pentanomial) const {
-        auto pairs            = std::accumulate(pentanomial.begin(), pentanomial.end(), 0);
-        const double WW       = double(pentanomial[4]) / pairs;
-        const double WD       = double(pentanomial[3]) / pairs;
-        const double WLDD     = double(pentanomial[2]) / pairs;
-        const double LD       = double(pentanomial[1]) / pairs;
-        const double LL       = double(pentanomial[0]) / pairs;
-        const double score    = WW + 0.75 * WD + 0.5 * WLDD + 0.25 * LD;
-        const double WW_dev   = WW * std::pow((1 - score), 2);
-        const double WD_dev   = WD * std::pow((0.75 - score), 2);
-        const double WLDD_dev = WLDD * std::pow((0.5 - score), 2);
-        const double LD_dev   = LD * std::pow((0.25 - score), 2);
-        const double LL_dev   = LL * std::pow((0 - score), 2);
-        const double variance = WW_dev + WD_dev + WLDD_dev + LD_dev + LL_dev;
-        return (score - 0.5) / std::sqrt(2 * variance) * (800 / std::log(10));
-    }
+            // the scores of a win, draw and loss are 1, 0.5 and 0
+            const double score_difference = rates[0] + 0.5 * rates[1] - (2 - outcome) / 2.0;
 
-    bool apply(const std::string &filename, const map_meta &meta_map) const {
-        if (meta_map.find(filename) == meta_map.end()) {
-            return true;
+            positions += count;
+            log_loss -= count * std::log(std::max(rates[outcome], 1e-14));
+            brier += count * squares;
+            score_error += count * score_difference * score_difference;
         }
 
-        if (!meta_map.at(filename).pentanomial.has_value()) {
-            return true;
-        }
+        json to_json() const {
+            const double n = std::max<std::uint64_t>(positions, 1);
 
-        double fileEloDiff = pentanomialToEloDiff(meta_map.at(filename).pentanomial.value());
-        if (EloDiffMin <= fileEloDiff && fileEloDiff <= EloDiffMax) {
-            return false;
+            return {{"positions", positions},
+                    {"logLoss", log_loss / n},
+                    {"brier", brier / n},
+                    {"scoreError", std::sqrt(score_error / n)},
+                    {"predicted", {predicted[0] / n, predicted[1] / n, predicted[2] / n}},
+                    {"observed", {observed[0] / n, observed[1] / n, observed[2] / n}}};
         }
+    };
 
-        return true;
-    }
+    const WdlModel &model;
+    const Binning eval_binning;
+
+    Bin total;
+    std::map<int, Bin> by_material, by_eval;
 };
 
-class SprtFilterStrategy {
-   public:
-    bool apply(const std::string &filename, const map_meta &meta_map) const {
-        // check if metadata and "sprt" entry exist
-        if (meta_map.find(filename) != meta_map.end() && meta_map.at(filename).sprt.has_value() &&
-            meta_map.at(filename).sprt.value()) {
-            return false;
-        }
+/// @brief Ranks of the decimal strings of the integers in [first, last] in lexicographic order.
+/// @param first
+/// @param last
+/// @return the rank of each integer, at index integer - first
+[[nodiscard]] std::vector<std::uint32_t> decimal_ranks(int first, int last) {
+    std::vector<int> values(last - first + 1);
+    std::iota(values.begin(), values.end(), first);
 
-        return true;
-    }
-};
+    std::sort(values.begin(), values.end(),
+              [](int a, int b) { return std::to_string(a) < std::to_string(b); });
 
-void process(const std::vector<std::string> &files_pgn, const std::string &regex_engine,
-             const map_fens &fixfen_map, int concurrency, int bin_width) {
-    // Create more chunks than threads to prevent threads from idling.
-    int target_chunks = 4 * concurrency;
+    std::vector<std::uint32_t> ranks(values.size());
 
-    auto files_chunked = split_chunks(files_pgn, target_chunks);
+    for (std::size_t i = 0; i < values.size(); ++i) {
+        ranks[values[i] - first] = i;
+    }
 
-    std::cout << "Found " << files_pgn.size() << " .pgn(.gz) files, creating "
-              << files_chunked.size() << " chunks for processing." << std::endl;
+    return ranks;
+}
 
-    // Mutex for progress success
-    std::mutex progress_mutex;
+/// @brief Bin the evals of the position map and the spilled counts and save them to a json file.
+/// The json is written as a stream, in the format of nlohmann::json::dump(2) but without
+/// building the document in memory.
+/// @param json_filename
+/// @param binning
+void save(const std::string &json_filename, const Binning &binning) {
+    // A json object has its keys in the order of their strings, e.g. "('D', 10, 58, -5)". As a
+    // number is followed by a character less than any digit, that is the order of the result
+    // and the strings of the numbers one by one.
+    static const auto number_ranks = decimal_ranks(0, 255);
+    static const auto eval_ranks   = decimal_ranks(-(1 << 13), (1 << 13) - 1);
+
+    const auto order = [](PackedKey packed) {
+        const Key key = packed.unpack();
+
+        return std::uint64_t(number_ranks[key.move]) << 32 |
+               std::uint64_t(number_ranks[key.material]) << 16 |
+               std::uint64_t(eval_ranks[key.eval + (1 << 13)]);
+    };
 
-    // Create a thread pool
-    ThreadPool pool(concurrency);
+    std::ofstream out_file(json_filename);
+    std::uint64_t total_pos = 0, total_keys = 0;
 
-    // Print progress
-    std::cout << "\rProgress: " << total_chunks << "/" << files_chunked.size() << std::flush;
+    // the keys of one result at a time, which come in sequence in the output
+    for (const Result result : {Result::DRAW, Result::LOSS, Result::WIN}) {
+        map_binned_t binned_map;
 
-    for (const auto &files : files_chunked) {
-        pool.enqueue(
-            [&files, &regex_engine, &fixfen_map, &progress_mutex, &files_chunked, &bin_width]() {
-                analysis::ana_files(files, regex_engine, fixfen_map, bin_width);
+        const auto add = [&](PackedKey packed, std::uint64_t count) {
+            Key key = packed.unpack();
 
-                total_chunks++;
+            if (key.result != result) return;
 
-                // Limit the scope of the lock
-                {
-                    const std::lock_guard<std::mutex> lock(progress_mutex);
+            key.eval = binning(key.eval);
+            binned_map[PackedKey(key)] += count;
+        };
 
-                    // Print progress
-                    std::cout << "\rProgress: " << total_chunks << "/" << files_chunked.size()
-                              << std::flush;
-                }
-            });
-    }
+        for (const auto &pair : pos_map) {
+            add(pair.first, pair.second);
+        }
 
-    // Wait for all threads to finish
-    pool.wait();
-}
+        spill.for_each(add);
 
-/// @brief Save the position map to a json file.
-/// @param json_filename
-void save(const std::string &json_filename) {
-    std::uint64_t total_pos = 0;
+        std::vector<PackedKey> keys;
+        keys.reserve(binned_map.size());
+
+        for (const auto &pair : binned_map) {
+            keys.push_back(pair.first);
+            total_pos += pair.second;
+        }
 
-    json j;
+        std::sort(keys.begin(), keys.end(),
+                  [&](PackedKey a, PackedKey b) { return order(a) < order(b); });
 
-    for (const auto &pair : pos_map) {
-        const auto map_key_t = static_cast<std::string>(pair.first);
-        j[map_key_t]         = pair.second;
-        total_pos += pair.second;
+        for (const auto key : keys) {
+            out_file << (total_keys++ ? ",\n" : "{\n") << "  \""
+                     << static_cast<std::string>(key.unpack()) << "\": " << binned_map[key];
+        }
     }
 
-    // save json to file
-    std::ofstream out_file(json_filename);
-    out_file << j.dump(2);
+    // like the json document without any key
+    out_file << (total_keys ? "\n}" : "null");
     out_file.close();
 
     std::cout << "Wrote " << total_pos << " scored positions from " << total_games << " games to "
@@ -606,10 +2947,13 @@ void print_usage(char const *program_name) {
     // clang-format off
     ss << "Usage: " << program_name << " [options]" << "\n";
     ss << "Options:" << "\n";
-    ss << "  --file <path>         Path to .pgn(.gz) file" << "\n";
-    ss << "  --dir <path>          Path to directory containing .pgn(.gz) files (default: pgns)" << "\n";
-    ss << "  -r                    Search for .pgn(.gz) files recursively in subdirectories" << "\n";
+    ss << "  --file <path>         Path to .pgn(.gz|.zst) or .wdlbin file, or to a .tar(.gz) archive of" << "\n";
+    ss << "                        .pgn(.gz) and .json files, which is read as a stream like - (stdin)" << "\n";
+    ss << "  --dir <path>          Path to directory containing .pgn(.gz|.zst) or .wdlbin files (default: pgns)" << "\n";
+    ss << "  -r                    Search for .pgn(.gz|.zst) or .wdlbin files recursively in subdirectories" << "\n";
     ss << "  --allowDuplicates     Allow duplicate directories for test pgns" << "\n";
+    ss << "  --dedup               Skip games found before, by a fingerprint of their headers and first 8 moves" << "\n";
+    ss << "  --dedupFile <path>    Like --dedup, also skipping the games of previous runs saved to this file" << "\n";
     ss << "  --concurrency <N>     Number of concurrent threads to use (default: maximum)" << "\n";
     ss << "  --matchRev <regex>    Filter data based on revision SHA in metadata" << "\n";
     ss << "  --matchEngine <regex> Filter data based on engine name in pgns, defaults to matchRev if given" << "\n";
@@ -621,8 +2965,24 @@ void print_usage(char const *program_name) {
     ss << "  --EloDiffMin <Y>      Filter data based on estimated nElo difference (defaults to -X if X is given)" << "\n";
     ss << "  --SPRTonly            Analyse only pgns from SPRT tests" << "\n";
     ss << "  --fixFENsource        Patch move counters lost by cutechess-cli based on FENs in this file" << "\n";
-    ss << "  --binWidth            bin position scores for faster processing and smoother densities (default 5)" << "\n";
+    ss << "  --binWidth <specs>    Comma separated bin widths for position scores, each written to its own" << "\n";
+    ss << "                        output. A width may grow with |eval|, e.g. 5@200/10@500/25 (default 5)" << "\n";
     ss << "  -o <path>             Path to output json file (default: scoreWDLstat.json)" << "\n";
+    ss << "  --archive <path>      Convert the pgns to binary game archives (.wdlbin) in this directory," << "\n";
+    ss << "                        which are analysed much faster than pgns" << "\n";
+    ss << "  --checkpoint <path>   Periodically save the counts and completed files to this file" << "\n";
+    ss << "  --checkpointInterval <N> Seconds between checkpoints (default: 600), each waits for the files in" << "\n";
+    ss << "                        progress to finish, with the other threads idle" << "\n";
+    ss << "  --resume              Skip the files completed in --checkpoint and continue counting" << "\n";
+    ss << "  --readAhead <N>       Read up to N upcoming files asynchronously, with io_uring where available" << "\n";
+    ss << "  --readAheadMemory <N> Memory in MiB for the files read ahead (default: 1024)" << "\n";
+    ss << "  --numa                Pin the threads to cores spread over the NUMA nodes, with node-local counts" << "\n";
+    ss << "  --maxMemory <N>       Memory budget in MiB, bounding threads and buffers and spilling counts to disk," << "\n";
+    ss << "                        not covering the fingerprints that --dedup adds during the run" << "\n";
+    ss << "  --model <json|path>   Score a WDL model of scoreWDL.py, given as json with the keys of its options," << "\n";
+    ss << "                        e.g. {\"momType\": \"material\", \"momTarget\": 58, \"as\": [...], \"bs\": [...]}" << "\n";
+    ss << "  --modelReport <path>  Output of the model scores per material and eval bin (default: scoreWDLcalibration.json)" << "\n";
+    ss << "  --checkAllocations    Count the games that allocate heap memory after warm-up, fail if any" << "\n";
     ss << "  --help                Print this help message" << "\n";
     // clang-format on
 
@@ -644,8 +3004,6 @@ int main(int argc, char const *argv[]) {
     }
 #endif
 
-    pos_map.reserve(analysis::map_size);
-
     CommandLine cmd(argc, argv);
 
     std::vector<std::string> files_pgn;
@@ -653,7 +3011,7 @@ int main(int argc, char const *argv[]) {
     std::string default_path  = "./pgns";
     std::string regex_engine;
     map_fens fixfen_map;
-    int bin_width   = 5;
+    std::string bin_widths = "5";
     int concurrency = std::max(1, int(std::thread::hardware_concurrency()));
 
     if (cmd.has_argument("--help", true)) {
@@ -662,14 +3020,27 @@ int main(int argc, char const *argv[]) {
     }
 
     if (cmd.has_argument("--binWidth")) {
-        bin_width = std::stoi(cmd.get_argument("--binWidth"));
+        bin_widths = cmd.get_argument("--binWidth");
+    }
+
+    std::vector<Binning> binnings;
+
+    try {
+        binnings = parse_binnings(bin_widths);
+    } catch (const std::exception &e) {
+        std::cout << "Error: Invalid --binWidth: " << e.what() << std::endl;
+        std::exit(1);
     }
 
     if (cmd.has_argument("--concurrency")) {
         concurrency = std::stoi(cmd.get_argument("--concurrency"));
     }
 
-    if (cmd.has_argument("--file")) {
+    const bool streaming = cmd.has_argument("--file") && is_stream(cmd.get_argument("--file"));
+
+    if (streaming) {
+        // the pgns and their metadata are found while reading the stream
+    } else if (cmd.has_argument("--file")) {
         files_pgn = {cmd.get_argument("--file")};
     } else {
         auto path = cmd.get_argument("--dir", default_path);
@@ -680,11 +3051,18 @@ int main(int argc, char const *argv[]) {
 
         files_pgn = get_files(path, recursive);
 
-        // sort to easily check for "duplicate" files, i.e. "foo.pgn.gz" and "foo.pgn"
+        // sort to easily check for "duplicate" files, i.e. "foo.pgn.gz" and "foo.pgn",
+        // "foo.pgn.zst" or "foo.wdlbin", which sort next to each other
         std::sort(files_pgn.begin(), files_pgn.end());
 
+        const auto strip_extension = [](const std::string &file) {
+            const auto pos = file.rfind(".pgn");
+            return file.substr(
+                0, pos != std::string::npos ? pos : file.rfind(analysis::archive::extension));
+        };
+
         for (size_t i = 1; i < files_pgn.size(); ++i) {
-            if (files_pgn[i].find(files_pgn[i - 1]) == 0) {
+            if (strip_extension(files_pgn[i]) == strip_extension(files_pgn[i - 1])) {
                 std::cout << "Error: \"Duplicate\" files: " << files_pgn[i - 1] << " and "
                           << files_pgn[i] << std::endl;
                 std::exit(1);
@@ -692,12 +3070,17 @@ int main(int argc, char const *argv[]) {
         }
     }
 
-    std::cout << "Found " << files_pgn.size() << " .pgn(.gz) files in total." << std::endl;
+    if (!streaming) {
+        std::cout << "Found " << files_pgn.size() << " .pgn(.gz|.zst) files in total."
+                  << std::endl;
+    }
 
     auto meta_map = get_metadata(files_pgn, cmd.has_argument("--allowDuplicates", true));
 
+    std::vector<FileFilter> filters;
+
     if (cmd.has_argument("--SPRTonly", true)) {
-        filter_files(files_pgn, meta_map, SprtFilterStrategy());
+        filters.push_back(make_filter(SprtFilterStrategy()));
     }
 
     if (cmd.has_argument("--matchBook")) {
@@ -707,7 +3090,7 @@ int main(int argc, char const *argv[]) {
             bool invert = cmd.has_argument("--matchBookInvert", true);
             std::cout << "Filtering pgn files " << (invert ? "not " : "")
                       << "matching the book name " << regex_book << std::endl;
-            filter_files(files_pgn, meta_map, BookFilterStrategy(std::regex(regex_book), invert));
+            filters.push_back(make_filter(BookFilterStrategy(std::regex(regex_book), invert)));
         }
     }
 
@@ -716,7 +3099,7 @@ int main(int argc, char const *argv[]) {
 
         if (!regex_rev.empty()) {
             std::cout << "Filtering pgn files matching revision SHA " << regex_rev << std::endl;
-            filter_files(files_pgn, meta_map, RevFilterStrategy(std::regex(regex_rev)));
+            filters.push_back(make_filter(RevFilterStrategy(std::regex(regex_rev))));
         }
 
         regex_engine = regex_rev;
@@ -727,7 +3110,7 @@ int main(int argc, char const *argv[]) {
 
         if (!regex_tc.empty()) {
             std::cout << "Filtering pgn files matching TC " << regex_tc << std::endl;
-            filter_files(files_pgn, meta_map, TcFilterStrategy(std::regex(regex_tc)));
+            filters.push_back(make_filter(TcFilterStrategy(std::regex(regex_tc))));
         }
     }
 
@@ -735,7 +3118,7 @@ int main(int argc, char const *argv[]) {
         int threads = std::stoi(cmd.get_argument("--matchThreads"));
 
         std::cout << "Filtering pgn files using threads = " << threads << std::endl;
-        filter_files(files_pgn, meta_map, ThreadsFilterStrategy(threads));
+        filters.push_back(make_filter(ThreadsFilterStrategy(threads)));
     }
 
     if (cmd.has_argument("--EloDiffMax") || cmd.has_argument("--EloDiffMin")) {
@@ -754,9 +3137,11 @@ int main(int argc, char const *argv[]) {
                       << std::endl;
         }
 
-        filter_files(files_pgn, meta_map, EloFilterStrategy(mi, ma));
+        filters.push_back(make_filter(EloFilterStrategy(mi, ma)));
     }
 
+    filter_files(files_pgn, meta_map, filters);
+
     if (cmd.has_argument("--fixFENsource")) {
         fixfen_map = get_fixfen(cmd.get_argument("--fixFENsource"));
     }
@@ -769,15 +3154,282 @@ int main(int argc, char const *argv[]) {
         json_filename = cmd.get_argument("-o");
     }
 
+    // a model to score against the counted positions, given as json or as a json file
+    std::optional<WdlModel> model;
+    int eval_bin_width = 25;
+
+    if (cmd.has_argument("--model")) {
+        const auto spec = cmd.get_argument("--model");
+
+        try {
+            json j;
+
+            if (!spec.empty() && spec[0] == '{') {
+                j = json::parse(spec);
+            } else {
+                std::ifstream model_file(spec);
+
+                if (!model_file.is_open()) {
+                    throw std::invalid_argument("could not open " + spec);
+                }
+
+                j = json::parse(model_file);
+            }
+
+            model.emplace(j);
+            eval_bin_width = j.value("evalBinWidth", eval_bin_width);
+
+            if (eval_bin_width <= 0) {
+                throw std::invalid_argument("evalBinWidth must be positive");
+            }
+        } catch (const std::exception &e) {
+            std::cout << "Error: Invalid --model: " << e.what() << std::endl;
+            std::exit(1);
+        }
+    }
+
+    if (cmd.has_argument("--archive")) {
+        if (streaming) {
+            std::cout << "Error: --archive needs pgn files on disk." << std::endl;
+            std::exit(1);
+        }
+
+        const auto root = cmd.has_argument("--file") ? "" : cmd.get_argument("--dir", default_path);
+        archive_files(files_pgn, root, cmd.get_argument("--archive"), concurrency);
+        return 0;
+    }
+
+    auto sources = analysis::make_sources(files_pgn);
+
+    const std::string dedup_filename = cmd.get_argument("--dedupFile");
+
+    if (cmd.has_argument("--dedup", true) || !dedup_filename.empty()) {
+        game_set.enable();
+
+        if (!dedup_filename.empty() && game_set.load(dedup_filename)) {
+            std::cout << "Skipping the " << game_set.size() << " games of " << dedup_filename
+                      << "." << std::endl;
+        }
+    }
+
+    // the fingerprints and the checkpoint are loaded before the memory is planned, which measures
+    // them, while the counts of the checkpoint need the planned map and spill
+    bool resumed = false;
+
+    if (cmd.has_argument("--checkpoint")) {
+        int interval = 600;
+        if (cmd.has_argument("--checkpointInterval")) {
+            interval = std::stoi(cmd.get_argument("--checkpointInterval"));
+        }
+
+        // a checkpoint can only be resumed with the inputs and options that select the counted
+        // games, and with the same content of the fixFENsource file
+        std::string config = "matchEngine=" + regex_engine;
+
+        for (const std::string option : {"--file", "--dir", "--matchRev", "--matchTC",
+                                         "--matchThreads", "--matchBook", "--EloDiffMin",
+                                         "--EloDiffMax", "--dedupFile"}) {
+            config += " " + option + "=" + cmd.get_argument(option);
+        }
+
+        for (const std::string flag :
+             {"-r", "--matchBookInvert", "--SPRTonly", "--allowDuplicates", "--dedup"}) {
+            config += " " + flag + "=" + (cmd.has_argument(flag, true) ? "yes" : "no");
+        }
+
+        if (cmd.has_argument("--fixFENsource")) {
+            std::ifstream fixfen_file(cmd.get_argument("--fixFENsource"), std::ios::binary);
+            const std::string content((std::istreambuf_iterator<char>(fixfen_file)),
+                                      std::istreambuf_iterator<char>());
+
+            FingerprintHasher hasher;
+            hasher.add(content);
+            const auto digest = hasher.finish();
+
+            config += " fixFENsource=" + std::to_string(digest.low) + std::to_string(digest.high);
+        }
+
+        checkpoint.enable(cmd.get_argument("--checkpoint"), config, std::max(1, interval));
+
+        if (cmd.has_argument("--resume", true)) {
+            resumed = checkpoint.load();
+
+            if (resumed) {
+                const auto it = std::remove_if(
+                    sources.begin(), sources.end(),
+                    [](const PgnSource &source) { return checkpoint.is_completed(source.id()); });
+                sources.erase(it, sources.end());
+
+                std::cout << "Resuming from " << cmd.get_argument("--checkpoint") << " with "
+                          << checkpoint.completed_count() << " completed sources and "
+                          << total_games << " games." << std::endl;
+            } else {
+                std::cout << "No checkpoint found at " << cmd.get_argument("--checkpoint")
+                          << ", starting from scratch." << std::endl;
+            }
+        }
+    } else if (cmd.has_argument("--resume", true)) {
+        std::cout << "Error: --resume requires --checkpoint <path>." << std::endl;
+        std::exit(1);
+    }
+
+    // the memory of the sources waiting for workers in a stream, or read ahead
+    std::uint64_t buffer_memory = std::numeric_limits<std::uint64_t>::max();
+    std::uint64_t budget        = 0;
+    bool numa_aware             = cmd.has_argument("--numa", true);
+
+    if (cmd.has_argument("--maxMemory")) {
+        budget          = std::stoull(cmd.get_argument("--maxMemory")) << 20;
+        const auto plan = plan_memory(budget, concurrency);
+
+        concurrency   = plan.concurrency;
+        buffer_memory = plan.buffers;
+
+        spill.enable(json_filename + ".spill", plan.map_slots);
+        checkpoint.enable_gate();
+        pos_map.rehash(plan.map_slots);
+
+#ifdef __GLIBC__
+        // a fixed threshold stops glibc from raising it after large buffers are freed, which
+        // would then be allocated in the heap and kept there
+        mallopt(M_MMAP_THRESHOLD, 256 << 10);
+#endif
+
+        std::cout << "Memory budget of " << (budget >> 20) << " MiB: " << concurrency
+                  << " threads, " << (buffer_memory >> 20) << " MiB for buffers and "
+                  << plan.map_slots << " map slots, spilling to " << json_filename
+                  << ".spill* when full." << std::endl;
+
+        if (numa_aware) {
+            std::cout << "Warning: --numa is ignored with --maxMemory, merging the node maps "
+                         "would need a second map."
+                      << std::endl;
+            numa_aware = false;
+        }
+    } else {
+        pos_map.reserve(analysis::map_size);
+    }
+
+    if (resumed) {
+        checkpoint.load_counts();
+    }
+
+    check_allocations = cmd.has_argument("--checkAllocations", true);
+
     const auto t0 = std::chrono::high_resolution_clock::now();
-    process(files_pgn, regex_engine, fixfen_map, concurrency, bin_width);
+    if (streaming) {
+        process_stream(cmd.get_argument("--file"), filters, regex_engine, fixfen_map, concurrency,
+                       buffer_memory);
+    } else if (cmd.has_argument("--readAhead")) {
+        if (numa_aware) {
+            std::cout << "Warning: --numa is ignored with --readAhead, whose workers count into "
+                         "a single map."
+                      << std::endl;
+        }
+
+        const auto depth  = std::stoul(cmd.get_argument("--readAhead"));
+        const auto memory = std::min<std::uint64_t>(
+            std::stoull(cmd.get_argument("--readAheadMemory", "1024")) << 20, buffer_memory);
+
+        process_readahead(sources, regex_engine, fixfen_map, concurrency,
+                          std::max(1ul, depth), std::max<std::uint64_t>(1 << 20, memory));
+    } else {
+        process(sources, regex_engine, fixfen_map, concurrency, numa_aware);
+    }
     const auto t1 = std::chrono::high_resolution_clock::now();
 
     std::cout << "\nTime taken: "
               << std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count() / 1000.0
               << "s" << std::endl;
 
-    save(json_filename);
+    if (san_lookups > 0) {
+        std::cout << "SAN cache hits: " << std::fixed << std::setprecision(1)
+                  << 100.0 * san_hits / san_lookups << "% of " << san_lookups << " lookups."
+                  << std::defaultfloat << std::endl;
+    }
+
+    if (check_allocations) {
+        std::cout << "Allocation check: " << allocating_games << " of " << checked_games
+                  << " games allocated heap memory." << std::endl;
+    }
+
+    if (model) {
+        Calibration calibration(*model, eval_bin_width);
 
-    return 0;
+        for (const auto &pair : pos_map) {
+            calibration.add(pair.first, pair.second);
+        }
+
+        spill.for_each([&](PackedKey key, std::uint32_t count) { calibration.add(key, count); });
+
+        calibration.save(cmd.get_argument("--modelReport", "scoreWDLcalibration.json"));
+    }
+
+    // with spill files, the output is binned from them alone, such that the memory of the map
+    // is free for it
+    if (spill.file_count() > 0) {
+        spill.write();
+        pos_map.rehash(0);
+    }
+
+    if (binnings.size() == 1) {
+        save(json_filename, binnings.front());
+    } else {
+        // one output per binning, e.g. scoreWDLstat_bin5at200-10.json for 5@200/10
+        const fs::path path(json_filename);
+
+        for (const auto &binning : binnings) {
+            std::string suffix = "_bin";
+
+            for (const char c : binning.name()) {
+                if (c == '@') {
+                    suffix += "at";
+                } else if (c == '/') {
+                    suffix += '-';
+                } else {
+                    suffix += c;
+                }
+            }
+
+            const auto filename =
+                path.parent_path() / (path.stem().string() + suffix + path.extension().string());
+            save(filename.string(), binning);
+        }
+    }
+
+    if (spill.file_count() > 0) {
+        std::cout << "Spilled " << spill.entries() << " counts to " << spill.file_count()
+                  << " files." << std::endl;
+    }
+
+    spill.remove();
+
+    if (game_set.enabled()) {
+        std::cout << "Skipped " << game_set.duplicates() << " duplicate games";
+
+        if (!dedup_filename.empty()) {
+            game_set.save(dedup_filename);
+            std::cout << ", saved " << game_set.size() << " game fingerprints to "
+                      << dedup_filename;
+        }
+
+        std::cout << "." << std::endl;
+    }
+
+    checkpoint.remove();
+
+    if (const auto peak = process_memory("VmHWM")) {
+        std::cout << "Peak memory: " << (peak >> 20) << " MiB";
+
+        if (budget > 0) {
+            std::cout << " of the " << (budget >> 20) << " MiB budget"
+                      << (peak > budget ? ", exceeded." : ".");
+        } else {
+            std::cout << ".";
+        }
+
+        std::cout << std::endl;
+    }
+
+    return allocating_games > 0 ? 1 : 0;
 }
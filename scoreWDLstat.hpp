@@ -1,15 +1,24 @@
 #include <zlib.h>
 
 #include <algorithm>
+#include <array>
 #include <charconv>
+#include <cmath>
 #include <cstdint>
+#include <cstring>
 #include <filesystem>
+#include <limits>
+#include <mutex>
 #include <optional>
+#include <stdexcept>
 #include <string>
 #include <string_view>
+#include <utility>
 #include <vector>
 
+#include "external/chess.hpp"
 #include "external/json.hpp"
+#include "external/parallel_hashmap/phmap.h"
 
 enum class Result { WIN = 'W', DRAW = 'D', LOSS = 'L' };
 
@@ -50,6 +59,340 @@ struct std::equal_to<Key> {
     bool operator()(const Key &lhs, const Key &rhs) const { return lhs == rhs; }
 };
 
+/// @brief A Key with the eval at full 1cp resolution, packed into 32 bits to keep the counting
+/// map compact: 2 bits result, 8 bits move, 8 bits material and 14 bits eval.
+struct PackedKey {
+    std::uint32_t data;
+
+    PackedKey() = default;
+    explicit PackedKey(const Key &k)
+        : data(std::uint32_t(result_index(k.result)) << 30 | std::uint32_t(k.move & 0xFF) << 22 |
+               std::uint32_t(k.material & 0xFF) << 14 | std::uint32_t(k.eval + eval_offset)) {}
+
+    bool operator==(const PackedKey &k) const { return data == k.data; }
+
+    Key unpack() const {
+        static constexpr Result results[] = {Result::WIN, Result::DRAW, Result::LOSS};
+
+        Key k;
+        k.result   = results[data >> 30];
+        k.move     = (data >> 22) & 0xFF;
+        k.material = (data >> 14) & 0xFF;
+        k.eval     = int(data & 0x3FFF) - eval_offset;
+        return k;
+    }
+
+   private:
+    // evals are clamped to [-1000, 1000], mate scores are -1001 and 1001
+    static constexpr int eval_offset = 1 << 13;
+
+    static constexpr int result_index(Result r) {
+        return r == Result::WIN ? 0 : r == Result::DRAW ? 1 : 2;
+    }
+};
+
+template <>
+struct std::hash<PackedKey> {
+    std::size_t operator()(const PackedKey &k) const { return k.data; }
+};
+
+// unordered map to count (result, move, material, eval) tuples in pgns, evals at 1cp resolution
+using map_t = phmap::parallel_flat_hash_map<
+    PackedKey, std::uint32_t, std::hash<PackedKey>, std::equal_to<PackedKey>,
+    std::allocator<std::pair<const PackedKey, std::uint32_t>>, 8, std::mutex>;
+
+/// @brief A 128 bit fingerprint of a game, to recognize the same game in several files.
+struct GameFingerprint {
+    std::uint64_t low, high;
+
+    bool operator==(const GameFingerprint &f) const { return low == f.low && high == f.high; }
+};
+
+template <>
+struct std::hash<GameFingerprint> {
+    // the lanes are mixed already
+    std::size_t operator()(const GameFingerprint &f) const { return f.low; }
+};
+
+/// @brief Hashes the fields of a game into a GameFingerprint, 8 bytes at a time in two lanes with
+/// different multipliers and rotations. Never allocates.
+class FingerprintHasher {
+   public:
+    void reset() {
+        low  = 0x243f6a8885a308d3ull;
+        high = 0x13198a2e03707344ull;
+    }
+
+    /// @brief Add a field, its length separates it from the next one, e.g. a header's value from
+    /// the next key.
+    void add(std::string_view field) {
+        std::size_t i = 0;
+
+        for (; i + 8 <= field.size(); i += 8) {
+            std::uint64_t word;
+            std::memcpy(&word, field.data() + i, 8);
+            mix(word);
+        }
+
+        // the data of an empty field may be null, which memcpy must not get even for 0 bytes
+        std::uint64_t tail = 0;
+        if (i < field.size()) std::memcpy(&tail, field.data() + i, field.size() - i);
+        mix(tail ^ std::uint64_t(field.size()) << 56);
+    }
+
+    GameFingerprint finish() const { return {finalize(low), finalize(high ^ low)}; }
+
+   private:
+    static std::uint64_t rotl(std::uint64_t x, int r) { return x << r | x >> (64 - r); }
+
+    /// @brief The finalizer of MurmurHash3, such that all bits of the lanes are mixed.
+    static std::uint64_t finalize(std::uint64_t x) {
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdull;
+        x ^= x >> 33;
+        x *= 0xc4ceb9fe1a85ec53ull;
+        return x ^ x >> 33;
+    }
+
+    void mix(std::uint64_t word) {
+        low  = rotl(low ^ word, 23) * 0x9e3779b97f4a7c15ull;
+        high = rotl(high + word, 31) * 0xc2b2ae3d27d4eb4full;
+    }
+
+    std::uint64_t low  = 0x243f6a8885a308d3ull;
+    std::uint64_t high = 0x13198a2e03707344ull;
+};
+
+/// @brief Maps the 1cp evals of the counted positions to the bins used in the output.
+/// A spec is either a uniform width, e.g. "5", or a list of widths that apply up to
+/// the given |eval|, e.g. "5@200/10@500/25" for bins that are wider at large |eval|.
+class Binning {
+   public:
+    explicit Binning(const std::string &spec) : spec(spec) {
+        std::size_t begin = 0;
+
+        while (begin <= spec.size()) {
+            auto end = spec.find('/', begin);
+            if (end == std::string::npos) end = spec.size();
+
+            const auto segment = spec.substr(begin, end - begin);
+            const auto at      = segment.find('@');
+
+            const int width = std::stoi(segment.substr(0, at));
+            const int limit = at == std::string::npos ? std::numeric_limits<int>::max()
+                                                      : std::stoi(segment.substr(at + 1));
+
+            const int start = segments.empty() ? 0 : segments.back().second;
+
+            if (width <= 0 || limit <= start) {
+                throw std::invalid_argument("Invalid bin specification " + spec);
+            }
+
+            // such that the bins of a segment end at its limit and stay in the order of the evals
+            if (at != std::string::npos && (limit - start) % width != 0) {
+                throw std::invalid_argument("Bin specification " + spec + " has a limit " +
+                                            std::to_string(limit) + " that is not " +
+                                            std::to_string(start) + " plus a multiple of " +
+                                            std::to_string(width));
+            }
+
+            segments.emplace_back(width, limit);
+
+            if (at == std::string::npos) break;
+
+            begin = end + 1;
+        }
+
+        if (segments.empty() || segments.back().second != std::numeric_limits<int>::max()) {
+            throw std::invalid_argument("Bin specification " + spec + " must end with a width");
+        }
+
+        const int width = segments[0].first;
+
+        if (segments.size() == 1 && (width & (width - 1)) == 0) {
+            while ((1 << shift) < width) shift++;
+        } else {
+            shift = -1;
+        }
+    }
+
+    /// @brief The representative eval of the bin that contains eval, mate scores are kept.
+    int operator()(int eval) const {
+        if (eval == 1001 || eval == -1001) {
+            return eval;
+        }
+
+        if (shift >= 0) {
+            // rounds half away from zero, like std::round
+            const int value = (std::abs(eval) + (1 << shift >> 1)) >> shift << shift;
+            return eval < 0 ? -value : value;
+        }
+
+        if (segments.size() == 1) {
+            const int width = segments[0].first;
+            return int(std::round(eval / float(width))) * width;
+        }
+
+        const int sign  = eval < 0 ? -1 : 1;
+        const int value = std::abs(eval);
+        int start       = 0;
+
+        for (const auto &[width, limit] : segments) {
+            if (value <= limit) {
+                return sign * (start + int(std::round((value - start) / float(width))) * width);
+            }
+
+            start = limit;
+        }
+
+        return eval;
+    }
+
+    const std::string &name() const { return spec; }
+
+   private:
+    std::string spec;
+
+    // pairs of bin width and the largest |eval| it applies to
+    std::vector<std::pair<int, int>> segments;
+
+    // log2 of a uniform width that is a power of two, else -1
+    int shift = 0;
+};
+
+/// @brief Parse a comma separated list of bin specifications.
+/// @param specs
+/// @return
+[[nodiscard]] inline std::vector<Binning> parse_binnings(const std::string &specs) {
+    std::vector<Binning> binnings;
+    std::size_t begin = 0;
+
+    while (begin <= specs.size()) {
+        auto end = specs.find(',', begin);
+        if (end == std::string::npos) end = specs.size();
+
+        binnings.emplace_back(specs.substr(begin, end - begin));
+        begin = end + 1;
+    }
+
+    return binnings;
+}
+
+/// @brief The WDL model of scoreWDL.py: for an internal eval x, W(x) = 1 / (1 + exp(-(x - a) / b)),
+/// L(x) = W(-x) and D(x) = 1 - W(x) - L(x), where a and b are polynomials in mom / momTarget and
+/// mom is the move or material count. The cp evals of the pgns are converted to internal evals
+/// with NormalizeData or NormalizeToPawnValue, and filtered, like scoreWDL.py loads its data.
+/// The json has the keys of the options of scoreWDL.py, with the same defaults, e.g.
+/// {"momType": "material", "momTarget": 58, "as": [c_3, c_2, c_1, c_0], "bs": [...]}
+class WdlModel {
+   public:
+    using Rates = std::array<double, 3>;
+
+    explicit WdlModel(const nlohmann::json &j) {
+        const auto coefficients = [&](const nlohmann::json &object, const char *name) {
+            const auto c = object.at(name).get<std::vector<double>>();
+
+            if (c.size() != 4) {
+                throw std::invalid_argument(std::string(name) + " must have 4 coefficients");
+            }
+
+            return c;
+        };
+
+        const auto mom_by_move = [](const std::string &type) {
+            if (type != "move" && type != "material") {
+                throw std::invalid_argument("momType must be move or material");
+            }
+
+            return type == "move";
+        };
+
+        by_move      = mom_by_move(j.value("momType", "material"));
+        move_min     = j.value("moveMin", 1);
+        move_max     = j.value("moveMax", 120);
+        material_min = j.value("materialMin", 17);
+        material_max = j.value("materialMax", 78);
+
+        const auto as       = coefficients(j, "as");
+        const auto bs       = coefficients(j, "bs");
+        const double target = j.value("momTarget", 58);
+
+        // the normalization of the cp evals, by default that of scoreWDL.py
+        const auto normalize = j.value(
+            "NormalizeData", nlohmann::json::parse(R"({"momType": "material", "momMin": 17,
+                "momMax": 78, "momTarget": 58, "as": [-37.45051876, 121.19101539, -132.78783573,
+                420.70576692]})"));
+
+        const bool static_normalization = j.contains("NormalizeToPawnValue");
+        const auto normalize_as         = coefficients(normalize, "as");
+        const int pawn_value            = static_normalization
+                                              ? j.at("NormalizeToPawnValue").get<int>()
+                                              : int(normalize_as[0] + normalize_as[1] +
+                                                    normalize_as[2] + normalize_as[3] + 0.5);
+
+        eval_max = int(std::nearbyint(j.value("evalMax", 400) * pawn_value / 100.0));
+
+        // the polynomials for all values of the 8 bit move and material counts of a Key
+        for (int mom = 0; mom < 256; ++mom) {
+            a[mom] = poly3(mom / target, as);
+            b[mom] = poly3(mom / target, bs);
+
+            const int clamped = std::clamp(mom, normalize.at("momMin").get<int>(),
+                                           normalize.at("momMax").get<int>());
+
+            a_internal[mom] = static_normalization
+                                  ? pawn_value
+                                  : poly3(clamped / normalize.at("momTarget").get<double>(),
+                                          normalize_as);
+        }
+
+        normalize_by_move = mom_by_move(normalize.value("momType", "material"));
+    }
+
+    /// @brief The internal eval of a cp eval, rounded half to even like Python's round.
+    int internal_eval(int move, int material, int eval) const {
+        return int(std::nearbyint(eval * a_internal[normalize_by_move ? move : material] / 100));
+    }
+
+    /// @brief The predicted W, D and L rates of a position.
+    /// @return nullopt if the position is filtered
+    std::optional<Rates> rates(int move, int material, int eval) const {
+        if (move < move_min || move > move_max || material < material_min ||
+            material > material_max) {
+            return std::nullopt;
+        }
+
+        const int x = internal_eval(move, material, eval);
+
+        if (std::abs(x) > eval_max) {
+            return std::nullopt;
+        }
+
+        const int mom = by_move ? move : material;
+        const double w = win_rate(x, a[mom], b[mom]);
+        const double l = win_rate(-x, a[mom], b[mom]);
+
+        return Rates{w, 1 - w - l, l};
+    }
+
+   private:
+    static double poly3(double x, const std::vector<double> &c) {
+        return ((c[0] * x + c[1]) * x + c[2]) * x + c[3];
+    }
+
+    /// @brief Like scoreWDL.py, treats b < 1e-8 as 1e-8 and avoids overflows of exp.
+    static double win_rate(double x, double a, double b) {
+        const double z = (x - a) / std::max(b, 1e-8);
+        return z < 0 ? std::exp(z) / (1 + std::exp(z)) : 1 / (1 + std::exp(-z));
+    }
+
+    bool by_move           = false;
+    bool normalize_by_move = false;
+    int move_min, move_max, material_min, material_max, eval_max;
+
+    std::array<double, 256> a, b, a_internal;
+};
+
 struct TestMetaData {
     std::optional<std::string> book, new_tc, resolved_base, resolved_new, tc;
     std::optional<int> threads;
@@ -152,6 +495,78 @@ inline float fast_stof(std::string_view sw) {
 }
 #endif
 
+namespace analysis {
+
+/// @brief Eval of positions whose move comment has no engine eval
+static constexpr int no_eval = 1002;
+
+/// @brief Parse the engine's eval from a move comment.
+/// @param comment
+/// @return the eval in cp clamped to [-1000, 1000], mate scores as -1001 and 1001, or no_eval
+[[nodiscard]] inline int parse_eval(std::string_view comment) {
+    // openbench uses Nf3 {+0.57 17/28 583 363004}, fishtest Nf3 {+0.57/17}
+    const size_t delimiter_pos = comment.find_first_of(" /");
+
+    if (delimiter_pos == std::string::npos || comment == "book") {
+        return no_eval;
+    }
+
+    const auto match_eval = comment.substr(0, delimiter_pos);
+
+    if (match_eval.size() > 1 && match_eval[1] == 'M') {
+        return match_eval[0] == '+' ? 1001 : -1001;
+    }
+
+    int eval = 100 * fast_stof(match_eval.data());
+
+    if (eval > 1000) {
+        eval = 1000;
+    } else if (eval < -1000) {
+        eval = -1000;
+    }
+
+    return eval;
+}
+
+/// @brief Material count of the position, as (1,3,3,5,9) weighted sum of all pieces but kings
+[[nodiscard]] inline int material(const chess::Board &board) {
+    const auto knights = board.pieces(chess::PieceType::KNIGHT).count();
+    const auto bishops = board.pieces(chess::PieceType::BISHOP).count();
+    const auto rooks   = board.pieces(chess::PieceType::ROOK).count();
+    const auto queens  = board.pieces(chess::PieceType::QUEEN).count();
+    const auto pawns   = board.pieces(chess::PieceType::PAWN).count();
+
+    return 9 * queens + 5 * rooks + 3 * bishops + 3 * knights + pawns;
+}
+
+}  // namespace analysis
+
+/// @brief String with a fixed capacity, for pgn header values which the parser limits to 255
+/// characters anyway. Longer values are truncated, assignment never allocates.
+template <std::size_t N>
+class FixedString {
+   public:
+    FixedString &operator=(std::string_view value) {
+        size_ = std::min(value.size(), N);
+        std::copy_n(value.data(), size_, data_.data());
+        return *this;
+    }
+
+    operator std::string_view() const { return std::string_view(data_.data(), size_); }
+
+    bool empty() const { return size_ == 0; }
+
+    void clear() { size_ = 0; }
+
+   private:
+    std::array<char, N> data_;
+    std::size_t size_ = 0;
+};
+
+[[nodiscard]] inline bool ends_with(std::string_view str, std::string_view suffix) {
+    return str.size() >= suffix.size() && str.substr(str.size() - suffix.size()) == suffix;
+}
+
 /// @brief Get all files from a directory.
 /// @param path
 /// @param recursive
@@ -164,11 +579,11 @@ inline float fast_stof(std::string_view sw) {
         if (std::filesystem::is_regular_file(entry)) {
             std::string stem      = entry.path().stem().string();
             std::string extension = entry.path().extension().string();
-            if (extension == ".gz") {
+            if (extension == ".gz" || extension == ".zst") {
                 if (stem.size() >= 4 && stem.substr(stem.size() - 4) == ".pgn") {
                     files.push_back(entry.path().string());
                 }
-            } else if (extension == ".pgn") {
+            } else if (extension == ".pgn" || extension == ".wdlbin") {
                 files.push_back(entry.path().string());
             }
         } else if (recursive && std::filesystem::is_directory(entry)) {
@@ -180,23 +595,40 @@ inline float fast_stof(std::string_view sw) {
     return files;
 }
 
+/// @brief A unit of work: a whole pgn file, or a byte range of a seekable .pgn.zst file whose
+/// frames are aligned to game boundaries.
+struct PgnSource {
+    std::string file;
+    std::uint64_t begin = 0, end = 0;  // end == 0 for the whole file
+
+    /// @brief Unique name of the source, e.g. for checkpoints.
+    std::string id() const {
+        if (end == 0) {
+            return file;
+        }
+
+        return file + ":" + std::to_string(begin) + "-" + std::to_string(end);
+    }
+};
+
 /// @brief Split into successive n-sized chunks from pgns.
 /// @param pgns
 /// @param target_chunks
 /// @return
-[[nodiscard]] inline std::vector<std::vector<std::string>> split_chunks(
-    const std::vector<std::string> &pgns, int target_chunks) {
+template <typename T>
+[[nodiscard]] inline std::vector<std::vector<T>> split_chunks(const std::vector<T> &pgns,
+                                                              int target_chunks) {
     const int chunks_size = (pgns.size() + target_chunks - 1) / target_chunks;
 
     auto begin = pgns.begin();
     auto end   = pgns.end();
 
-    std::vector<std::vector<std::string>> chunks;
+    std::vector<std::vector<T>> chunks;
 
     while (begin != end) {
         auto next =
             std::next(begin, std::min(chunks_size, static_cast<int>(std::distance(begin, end))));
-        chunks.push_back(std::vector<std::string>(begin, next));
+        chunks.push_back(std::vector<T>(begin, next));
         begin = next;
     }
 
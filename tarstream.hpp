@@ -0,0 +1,354 @@
+#pragma once
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <istream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace tar {
+
+/// @brief Read-only streambuf over memory owned by the caller.
+class membuf : public std::streambuf {
+   public:
+    explicit membuf(std::string_view data) {
+        char *begin = const_cast<char *>(data.data());
+        setg(begin, begin, begin + data.size());
+    }
+};
+
+/// @brief Streambuf returning prefix, i.e. the bytes already read to detect the format of a
+/// stream, followed by the rest of source.
+class prefixbuf : public std::streambuf {
+   public:
+    prefixbuf(std::string prefix, std::streambuf *source)
+        : prefix(std::move(prefix)), source(source), buffer(1 << 16) {
+        setg(this->prefix.data(), this->prefix.data(), this->prefix.data() + this->prefix.size());
+    }
+
+   protected:
+    int_type underflow() override {
+        if (gptr() < egptr()) {
+            return traits_type::to_int_type(*gptr());
+        }
+
+        const auto n = source->sgetn(buffer.data(), buffer.size());
+
+        if (n <= 0) {
+            return traits_type::eof();
+        }
+
+        setg(buffer.data(), buffer.data(), buffer.data() + n);
+        return traits_type::to_int_type(*gptr());
+    }
+
+   private:
+    std::string prefix;
+    std::streambuf *source;
+    std::vector<char> buffer;
+};
+
+/// @brief Streambuf decompressing gzip data from source, which unlike igzstream need not be a
+/// file, e.g. stdin or a member of a tar archive. Concatenated gzip members are read in sequence.
+class gzbuf : public std::streambuf {
+   public:
+    explicit gzbuf(std::streambuf *source)
+        : source(source), in_buffer(1 << 16), out_buffer(1 << 16) {
+        stream.zalloc   = Z_NULL;
+        stream.zfree    = Z_NULL;
+        stream.opaque   = Z_NULL;
+        stream.next_in  = Z_NULL;
+        stream.avail_in = 0;
+
+        // 15 window bits plus 16 for a gzip header
+        inflateInit2(&stream, 15 + 16);
+    }
+
+    ~gzbuf() { inflateEnd(&stream); }
+
+    gzbuf(const gzbuf &)            = delete;
+    gzbuf &operator=(const gzbuf &) = delete;
+
+   protected:
+    int_type underflow() override {
+        if (gptr() < egptr()) {
+            return traits_type::to_int_type(*gptr());
+        }
+
+        while (!finished) {
+            if (stream.avail_in == 0) {
+                const auto n = source->sgetn(in_buffer.data(), in_buffer.size());
+
+                if (n <= 0) {
+                    finished = true;
+                    break;
+                }
+
+                stream.next_in  = reinterpret_cast<Bytef *>(in_buffer.data());
+                stream.avail_in = n;
+            }
+
+            stream.next_out  = reinterpret_cast<Bytef *>(out_buffer.data());
+            stream.avail_out = out_buffer.size();
+
+            const int ret       = inflate(&stream, Z_NO_FLUSH);
+            const auto produced = out_buffer.size() - stream.avail_out;
+
+            if (ret == Z_STREAM_END) {
+                if (stream.avail_in == 0 && source->sgetc() == traits_type::eof()) {
+                    finished = true;
+                } else {
+                    inflateReset(&stream);
+                }
+            } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                std::cerr << "Error while decompressing: "
+                          << (stream.msg ? stream.msg : "invalid gzip data") << std::endl;
+                finished = true;
+            }
+
+            if (produced > 0) {
+                setg(out_buffer.data(), out_buffer.data(), out_buffer.data() + produced);
+                return traits_type::to_int_type(*gptr());
+            }
+        }
+
+        return traits_type::eof();
+    }
+
+   private:
+    std::streambuf *source;
+    z_stream stream;
+    std::vector<char> in_buffer;
+    std::vector<char> out_buffer;
+    bool finished = false;
+};
+
+static constexpr std::size_t block_size = 512;
+
+/// @brief Whether the block is a tar header, judged by its checksum, which also accepts
+/// archives without the ustar magic.
+/// @param block
+/// @return
+[[nodiscard]] inline bool is_header(std::string_view block) {
+    if (block.size() < block_size) {
+        return false;
+    }
+
+    // the checksum is computed with its own field filled with spaces
+    std::uint32_t sum = 8 * ' ';
+
+    for (std::size_t i = 0; i < block_size; ++i) {
+        if (i < 148 || i >= 156) {
+            sum += static_cast<unsigned char>(block[i]);
+        }
+    }
+
+    std::uint32_t checksum = 0;
+    bool digits            = false;
+
+    for (std::size_t i = 148; i < 156; ++i) {
+        if (block[i] >= '0' && block[i] <= '7') {
+            checksum = checksum * 8 + (block[i] - '0');
+            digits   = true;
+        } else if (digits) {
+            break;
+        }
+    }
+
+    return digits && checksum == sum;
+}
+
+/// @brief Sequential reader of the regular files in a tar archive. Understands ustar, the
+/// long names of GNU tar and the path and size records of pax headers.
+class Reader {
+   public:
+    struct Member {
+        std::string name;
+        std::uint64_t size;
+    };
+
+    explicit Reader(std::istream &input) : input(input) {}
+
+    /// @brief Advance to the next regular file, skipping the data of the current one if it was
+    /// not read.
+    /// @param member
+    /// @return false at the end of the archive
+    [[nodiscard]] bool next(Member &member) {
+        skip();
+
+        std::string long_name;
+        std::uint64_t pax_size = 0;
+        bool has_pax_size      = false;
+        char block[block_size];
+
+        while (read_block(block)) {
+            // end of archive, marked by zero blocks
+            if (std::all_of(block, block + block_size, [](char c) { return c == 0; })) {
+                return false;
+            }
+
+            if (!is_header(std::string_view(block, block_size))) {
+                std::cerr << "Error: Invalid tar header." << std::endl;
+                return false;
+            }
+
+            const char type     = block[156];
+            const auto size     = parse_size(block + 124);
+            const auto data_end = padded(size);
+
+            if (type == 'L') {
+                // GNU tar: the data is the name of the next member
+                if (!read_string(size, long_name)) return false;
+                long_name.resize(std::strlen(long_name.c_str()));
+                continue;
+            }
+
+            if (type == 'x') {
+                std::string records;
+                if (!read_string(size, records)) return false;
+                parse_pax(records, long_name, pax_size, has_pax_size);
+                continue;
+            }
+
+            if (type != '0' && type != '\0' && type != '7') {
+                // directories, links, global pax headers and the like
+                if (!ignore(data_end)) return false;
+                long_name.clear();
+                has_pax_size = false;
+                continue;
+            }
+
+            member.size = has_pax_size ? pax_size : size;
+
+            if (!long_name.empty()) {
+                member.name = long_name;
+            } else {
+                member.name = field(block, 100);
+
+                // only POSIX ustar has a prefix field, the GNU format uses the space otherwise
+                if (std::memcmp(block + 257, "ustar\0", 6) == 0 && block[345] != '\0') {
+                    member.name = field(block + 345, 155) + "/" + member.name;
+                }
+            }
+
+            remaining = member.size;
+            padding   = padded(member.size) - member.size;
+
+            return true;
+        }
+
+        return false;
+    }
+
+    /// @brief Read the data of the current member.
+    /// @param data
+    /// @return false if the archive is truncated
+    [[nodiscard]] bool read(std::string &data) {
+        padding = 0;
+        return read_string(std::exchange(remaining, 0), data);
+    }
+
+   private:
+    static std::uint64_t padded(std::uint64_t size) {
+        return (size + block_size - 1) / block_size * block_size;
+    }
+
+    static std::string field(const char *p, std::size_t n) {
+        return std::string(p, std::find(p, p + n, '\0'));
+    }
+
+    /// @brief Octal size, or base-256 for sizes of 8GiB and more
+    static std::uint64_t parse_size(const char *p) {
+        std::uint64_t size = 0;
+
+        if (static_cast<unsigned char>(p[0]) & 0x80) {
+            for (int i = 1; i < 12; ++i) size = size << 8 | static_cast<unsigned char>(p[i]);
+            return size;
+        }
+
+        for (int i = 0; i < 12 && p[i]; ++i) {
+            if (p[i] >= '0' && p[i] <= '7') size = size * 8 + (p[i] - '0');
+        }
+
+        return size;
+    }
+
+    /// @brief pax records have the form "<length> <key>=<value>\n"
+    static void parse_pax(std::string_view records, std::string &path, std::uint64_t &size,
+                          bool &has_size) {
+        while (!records.empty()) {
+            const auto space  = records.find(' ');
+            const auto length = std::strtoull(std::string(records.substr(0, space)).c_str(),
+                                              nullptr, 10);
+
+            if (space == std::string_view::npos || length <= space || length > records.size()) {
+                return;
+            }
+
+            const auto record = records.substr(space + 1, length - space - 2);
+            const auto equals = record.find('=');
+
+            if (equals != std::string_view::npos) {
+                const auto key   = record.substr(0, equals);
+                const auto value = record.substr(equals + 1);
+
+                if (key == "path") {
+                    path = value;
+                } else if (key == "size") {
+                    size     = std::strtoull(std::string(value).c_str(), nullptr, 10);
+                    has_size = true;
+                }
+            }
+
+            records.remove_prefix(length);
+        }
+    }
+
+    bool read_block(char *block) {
+        return input.read(block, block_size) && input.gcount() == std::streamsize(block_size);
+    }
+
+    bool read_string(std::uint64_t size, std::string &data) {
+        data.resize(size);
+        input.read(data.data(), size);
+
+        if (std::uint64_t(input.gcount()) != size) {
+            std::cerr << "Error: Truncated tar archive." << std::endl;
+            return false;
+        }
+
+        return ignore(padded(size) - size);
+    }
+
+    bool ignore(std::uint64_t size) {
+        while (size > 0) {
+            const auto n = std::min<std::uint64_t>(size, 1 << 30);
+            input.ignore(n);
+
+            if (std::uint64_t(input.gcount()) != n) {
+                return false;
+            }
+
+            size -= n;
+        }
+
+        return true;
+    }
+
+    void skip() {
+        ignore(std::exchange(remaining, 0) + std::exchange(padding, 0));
+    }
+
+    std::istream &input;
+    std::uint64_t remaining = 0;
+    std::uint64_t padding   = 0;
+};
+
+}  // namespace tar
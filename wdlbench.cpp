@@ -0,0 +1,565 @@
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "external/chess.hpp"
+#include "external/gzip/gzstream.h"
+#include "external/json.hpp"
+#include "external/parallel_hashmap/phmap.h"
+#include "scoreWDLstat.hpp"
+#include "tarstream.hpp"
+
+#ifdef USE_ZSTD
+#include "zstdstream.hpp"
+#endif
+
+using namespace chess;
+
+using json = nlohmann::json;
+
+// sink for the results of the kernels, such that the compiler can not remove them
+volatile std::uint64_t sink = 0;
+
+/// @brief Cycles, instructions, cache misses and branch misses of the calling thread, counted in
+/// user space by one perf_event_open group. Unavailable without Linux, or if the kernel or a
+/// container does not allow the counters, e.g. because of perf_event_paranoid.
+class PerfCounters {
+   public:
+    struct Values {
+        std::uint64_t cycles, instructions, cache_misses, branch_misses;
+    };
+
+    PerfCounters() {
+#ifdef __linux__
+        static constexpr std::uint64_t configs[] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_BRANCH_MISSES};
+
+        for (std::size_t i = 0; i < fds.size(); ++i) {
+            perf_event_attr attr{};
+            attr.type           = PERF_TYPE_HARDWARE;
+            attr.size           = sizeof(attr);
+            attr.config         = configs[i];
+            attr.disabled       = i == 0;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv     = 1;
+            attr.read_format    = PERF_FORMAT_GROUP;
+
+            fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, i == 0 ? -1 : fds[0], 0);
+
+            if (fds[i] < 0) {
+                close_all();
+                return;
+            }
+        }
+#endif
+    }
+
+    ~PerfCounters() { close_all(); }
+
+    PerfCounters(const PerfCounters &)            = delete;
+    PerfCounters &operator=(const PerfCounters &) = delete;
+
+    bool available() const { return fds[0] >= 0; }
+
+    void start() {
+#ifdef __linux__
+        if (!available()) return;
+
+        ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+    }
+
+    Values stop() {
+        Values values{};
+
+#ifdef __linux__
+        if (!available()) return values;
+
+        ioctl(fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+        // PERF_FORMAT_GROUP: the number of counters, followed by their values
+        std::uint64_t data[1 + 4] = {};
+
+        if (read(fds[0], data, sizeof(data)) == sizeof(data)) {
+            values = {data[1], data[2], data[3], data[4]};
+        }
+#endif
+
+        return values;
+    }
+
+   private:
+    void close_all() {
+#ifdef __linux__
+        for (auto &fd : fds) {
+            if (fd >= 0) close(fd);
+            fd = -1;
+        }
+#endif
+    }
+
+    std::array<int, 4> fds = {-1, -1, -1, -1};
+};
+
+/// @brief The data the kernels run on, recorded once from the pgns.
+struct Recording {
+    struct Game {
+        std::string fen;
+        bool chess960;
+        std::vector<Move> moves;
+    };
+
+    std::string pgn;
+    std::vector<Game> games;
+
+    // a sample of the positions, with the SAN of the move played in them
+    std::vector<Board> boards;
+    std::vector<std::string> sans;
+    std::vector<std::string> fens;
+
+    std::vector<std::string> comments;
+    std::vector<PackedKey> keys;
+};
+
+/// @brief Records the games, positions, comments and position keys of the pgns, resolving moves
+/// like scoreWDLstat does.
+class Recorder : public pgn::Visitor {
+   public:
+    Recorder(Recording &recording, std::size_t max_positions)
+        : recording(recording), max_positions(max_positions) {}
+
+    void startPgn() override {
+        game  = {std::string(constants::STARTPOS), false, {}};
+        valid = false;
+        ply   = 0;
+    }
+
+    void header(std::string_view key, std::string_view value) override {
+        if (key == "FEN") {
+            game.fen = value;
+        }
+
+        if (key == "Variant" && value == "fischerandom") {
+            game.chess960 = true;
+        }
+
+        if (key == "Result") {
+            valid = value == "1-0" || value == "0-1" || value == "1/2-1/2";
+
+            resultkey.white = value == "1-0" ? Result::WIN : value == "0-1" ? Result::LOSS
+                                                                             : Result::DRAW;
+            resultkey.black = value == "1-0" ? Result::LOSS : value == "0-1" ? Result::WIN
+                                                                              : Result::DRAW;
+        }
+    }
+
+    void startMoves() override {
+        board.set960(game.chess960);
+        board.setFen(game.fen);
+    }
+
+    void move(std::string_view move, std::string_view comment) override {
+        if (!valid) {
+            return;
+        }
+
+        Move m;
+
+        try {
+            m = uci::parseSan(board, move);
+        } catch (const uci::AmbiguousMoveError &) {
+            m = Move::NO_MOVE;
+        }
+
+        if (m == Move::NO_MOVE) {
+            valid = false;
+            return;
+        }
+
+        // every 8th position, to spread the sample over the games
+        if (ply++ % 8 == 0 && recording.boards.size() < max_positions) {
+            recording.fens.push_back(board.getFen());
+            recording.boards.emplace_back(recording.fens.back(), game.chess960);
+            recording.sans.emplace_back(move);
+        }
+
+        // the keys of the evals scoreWDLstat counts, the comments of the evals that are not
+        // mate scores for fast_stof
+        const int eval = analysis::parse_eval(comment);
+
+        if (eval != analysis::no_eval) {
+            if (std::abs(eval) <= 1000) {
+                recording.comments.emplace_back(comment);
+            }
+
+            Key key;
+            key.result   = board.sideToMove() == Color::WHITE ? resultkey.white : resultkey.black;
+            key.move     = board.fullMoveNumber();
+            key.material = analysis::material(board);
+            key.eval     = eval;
+            recording.keys.emplace_back(key);
+        }
+
+        game.moves.push_back(m);
+        board.makeMove<true>(m);
+    }
+
+    void endPgn() override {
+        if (valid && !game.moves.empty()) {
+            recording.games.push_back(std::move(game));
+        }
+
+        board.set960(false);
+    }
+
+   private:
+    Recording &recording;
+    const std::size_t max_positions;
+
+    Board board;
+    Recording::Game game;
+    ResultKey resultkey;
+    bool valid      = false;
+    std::size_t ply = 0;
+};
+
+/// @brief Visitor that only lets the parser tokenize the games.
+class NullVisitor : public pgn::Visitor {
+   public:
+    void startPgn() override {}
+    void header(std::string_view, std::string_view) override {}
+    void startMoves() override {}
+    void move(std::string_view move, std::string_view) override { moves += move.size(); }
+    void endPgn() override { games++; }
+
+    std::uint64_t games = 0;
+    std::uint64_t moves = 0;
+};
+
+/// @brief A kernel is set up outside of the measurement, run returns the number of operations.
+struct Kernel {
+    std::string name;
+    std::function<void()> setup;
+    std::function<std::uint64_t()> run;
+};
+
+struct Measurement {
+    std::uint64_t ops = 0;
+    double ns         = std::numeric_limits<double>::infinity();
+    PerfCounters::Values counters{};
+};
+
+/// @brief Read the pgn files into memory, up to max_size bytes of complete files.
+[[nodiscard]] std::string load_pgns(const std::vector<std::string> &files, std::size_t max_size) {
+    std::string pgn;
+
+    for (const auto &file : files) {
+        if (pgn.size() >= max_size) break;
+
+        const auto append = [&](std::istream &input) {
+            pgn.append(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+            pgn += '\n';
+        };
+
+        if (ends_with(file, ".gz")) {
+            igzstream input(file.c_str());
+            append(input);
+#ifdef USE_ZSTD
+        } else if (ends_with(file, ".zst")) {
+            zstd::izstream input(file.c_str());
+            append(input);
+#endif
+        } else if (ends_with(file, ".pgn")) {
+            std::ifstream input(file, std::ios::binary);
+            append(input);
+        }
+    }
+
+    return pgn;
+}
+
+[[nodiscard]] std::vector<Kernel> make_kernels(const Recording &recording) {
+    std::vector<Kernel> kernels;
+
+    kernels.push_back({"readGames", {}, [&]() -> std::uint64_t {
+                           tar::membuf data(recording.pgn);
+                           std::istream input(&data);
+
+                           NullVisitor vis;
+                           pgn::StreamParser parser(input);
+                           parser.readGames(vis);
+
+                           sink = sink + vis.moves;
+                           return vis.games;
+                       }});
+
+    kernels.push_back({"parseSan", {}, [&]() -> std::uint64_t {
+                           Movelist moves;
+
+                           for (std::size_t i = 0; i < recording.boards.size(); ++i) {
+                               const auto m = uci::parseSan(recording.boards[i], recording.sans[i],
+                                                            moves);
+                               sink         = sink + m.move();
+                           }
+
+                           return recording.boards.size();
+                       }});
+
+    // includes one setFen per game
+    kernels.push_back({"makeMove", {}, [&]() -> std::uint64_t {
+                           Board board;
+                           std::uint64_t ops = 0;
+
+                           for (const auto &game : recording.games) {
+                               board.set960(game.chess960);
+                               board.setFen(game.fen);
+
+                               for (const auto m : game.moves) {
+                                   board.makeMove<true>(m);
+                               }
+
+                               ops += game.moves.size();
+                               sink = sink + board.hash();
+                           }
+
+                           return ops;
+                       }});
+
+    kernels.push_back({"setFen", {}, [&]() -> std::uint64_t {
+                           Board board;
+
+                           for (const auto &fen : recording.fens) {
+                               board.setFen(fen);
+                               sink = sink + board.hash();
+                           }
+
+                           return recording.fens.size();
+                       }});
+
+    kernels.push_back({"fast_stof", {}, [&]() -> std::uint64_t {
+                           float sum = 0;
+
+                           // called with the whole comment, like analysis::parse_eval does
+                           for (const auto &comment : recording.comments) {
+                               sum += fast_stof(comment.data());
+                           }
+
+                           sink = sink + std::uint64_t(sum);
+                           return recording.comments.size();
+                       }});
+
+    auto map = std::make_shared<map_t>();
+
+    kernels.push_back({"hash", {}, [&, map]() -> std::uint64_t {
+                           std::uint64_t sum = 0;
+
+                           for (const auto key : recording.keys) {
+                               sum += map->hash(key);
+                           }
+
+                           sink = sink + sum;
+                           return recording.keys.size();
+                       }});
+
+    // a fresh map reserved like pos_map, such that every repetition sees the same inserts
+    kernels.push_back({"lazy_emplace_l",
+                       [map]() {
+                           *map = map_t();
+                           map->reserve(6000000);
+                       },
+                       [&, map]() -> std::uint64_t {
+                           for (const auto key : recording.keys) {
+                               map->lazy_emplace_l(
+                                   key, [&](map_t::value_type &v) { v.second += 1; },
+                                   [&](const map_t::constructor &ctor) { ctor(key, 1); });
+                           }
+
+                           return recording.keys.size();
+                       }});
+
+    return kernels;
+}
+
+void print_usage(char const *program_name) {
+    std::stringstream ss;
+
+    // clang-format off
+    ss << "Usage: " << program_name << " [options]" << "\n";
+    ss << "Microbenchmarks of the chess.hpp and map kernels used by scoreWDLstat, on recorded games." << "\n";
+    ss << "Options:" << "\n";
+    ss << "  --file <path>         Path to .pgn(.gz|.zst) file" << "\n";
+    ss << "  --dir <path>          Path to directory containing .pgn(.gz|.zst) files (default: pgns)" << "\n";
+    ss << "  -r                    Search for .pgn(.gz|.zst) files recursively in subdirectories" << "\n";
+    ss << "  --maxSize <N>         Read complete files up to N MiB of pgn (default: 32)" << "\n";
+    ss << "  --positions <N>       Number of positions sampled for parseSan and setFen (default: 8192)" << "\n";
+    ss << "  --repeat <N>          Repetitions of each kernel, the fastest is reported (default: 5)" << "\n";
+    ss << "  -o <path>             Path to output json file (default: wdlbench.json)" << "\n";
+    ss << "  --help                Print this help message" << "\n";
+    // clang-format on
+
+    std::cout << ss.str();
+}
+
+int main(int argc, char const *argv[]) {
+    CommandLine cmd(argc, argv);
+
+    std::vector<std::string> files_pgn;
+    std::string json_filename = "wdlbench.json";
+    std::size_t max_size      = 32 << 20;
+    std::size_t max_positions = 8192;
+    int repeat                = 5;
+
+    if (cmd.has_argument("--help", true)) {
+        print_usage(argv[0]);
+        return 0;
+    }
+
+    if (cmd.has_argument("--file")) {
+        files_pgn = {cmd.get_argument("--file")};
+    } else {
+        files_pgn = get_files(cmd.get_argument("--dir", "./pgns"), cmd.has_argument("-r", true));
+        std::sort(files_pgn.begin(), files_pgn.end());
+    }
+
+    if (cmd.has_argument("--maxSize")) {
+        max_size = std::stoul(cmd.get_argument("--maxSize")) << 20;
+    }
+
+    if (cmd.has_argument("--positions")) {
+        max_positions = std::stoul(cmd.get_argument("--positions"));
+    }
+
+    if (cmd.has_argument("--repeat")) {
+        repeat = std::max(1, std::stoi(cmd.get_argument("--repeat")));
+    }
+
+    if (cmd.has_argument("-o")) {
+        json_filename = cmd.get_argument("-o");
+    }
+
+    Recording recording;
+    recording.pgn = load_pgns(files_pgn, max_size);
+
+    {
+        tar::membuf data(recording.pgn);
+        std::istream input(&data);
+
+        Recorder recorder(recording, max_positions);
+        pgn::StreamParser parser(input);
+        parser.readGames(recorder);
+    }
+
+    if (recording.games.empty()) {
+        std::cout << "Error: No games found to benchmark." << std::endl;
+        return 1;
+    }
+
+    std::cout << "Recorded " << recording.games.size() << " games, " << recording.pgn.size()
+              << " bytes of pgn, " << recording.boards.size() << " positions and "
+              << recording.keys.size() << " evals." << std::endl;
+
+    PerfCounters counters;
+
+    if (!counters.available()) {
+        std::cout << "Hardware counters are not available, reporting times only." << std::endl;
+    }
+
+    json kernels_json = json::array();
+
+    std::cout << std::left << std::setw(16) << "kernel" << std::right << std::setw(12) << "ops"
+              << std::setw(10) << "ns/op";
+
+    if (counters.available()) {
+        std::cout << std::setw(11) << "cycles/op" << std::setw(10) << "instr/op" << std::setw(7)
+                  << "IPC" << std::setw(12) << "cache-miss" << std::setw(13) << "branch-miss";
+    }
+
+    std::cout << std::endl;
+
+    for (const auto &kernel : make_kernels(recording)) {
+        Measurement best;
+
+        for (int i = 0; i < repeat; ++i) {
+            if (kernel.setup) kernel.setup();
+
+            counters.start();
+            const auto t0     = std::chrono::steady_clock::now();
+            const auto ops    = kernel.run();
+            const auto t1     = std::chrono::steady_clock::now();
+            const auto values = counters.stop();
+
+            const double ns = std::chrono::duration<double, std::nano>(t1 - t0).count();
+
+            if (ns < best.ns) {
+                best = {ops, ns, values};
+            }
+        }
+
+        const double ops = std::max<std::uint64_t>(best.ops, 1);
+
+        json entry = {{"name", kernel.name}, {"ops", best.ops}, {"ns_per_op", best.ns / ops}};
+
+        std::cout << std::left << std::setw(16) << kernel.name << std::right << std::setw(12)
+                  << best.ops << std::fixed << std::setprecision(2) << std::setw(10)
+                  << best.ns / ops;
+
+        if (counters.available()) {
+            const auto &c = best.counters;
+
+            entry["cycles_per_op"]        = c.cycles / ops;
+            entry["instructions_per_op"]  = c.instructions / ops;
+            entry["cache_misses_per_op"]  = c.cache_misses / ops;
+            entry["branch_misses_per_op"] = c.branch_misses / ops;
+
+            std::cout << std::setw(11) << c.cycles / ops << std::setw(10) << c.instructions / ops
+                      << std::setw(7) << (c.cycles ? double(c.instructions) / c.cycles : 0.0)
+                      << std::setw(12) << c.cache_misses / ops << std::setw(13)
+                      << c.branch_misses / ops;
+        } else {
+            for (const auto &key : {"cycles_per_op", "instructions_per_op", "cache_misses_per_op",
+                                    "branch_misses_per_op"}) {
+                entry[key] = nullptr;
+            }
+        }
+
+        std::cout << std::defaultfloat << std::endl;
+
+        kernels_json.push_back(entry);
+    }
+
+    const json results = {{"pgn_bytes", recording.pgn.size()},
+                          {"games", recording.games.size()},
+                          {"repeat", repeat},
+                          {"counters", counters.available()},
+                          {"kernels", kernels_json}};
+
+    std::ofstream out_file(json_filename);
+    out_file << results.dump(2);
+    out_file.close();
+
+    std::cout << "Wrote the results to " << json_filename << "." << std::endl;
+
+    return 0;
+}
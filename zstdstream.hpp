@@ -0,0 +1,206 @@
+#pragma once
+
+#include <zstd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <istream>
+#include <limits>
+#include <string>
+#include <vector>
+
+namespace zstd {
+
+/// @brief Magic numbers of the zstd seekable format, see
+/// https://github.com/facebook/zstd/blob/dev/contrib/seekable_format/zstd_seekable_compression_format.md
+static constexpr std::uint32_t skippable_magic = 0x184D2A5E;
+static constexpr std::uint32_t seekable_magic  = 0x8F92EAB1;
+static constexpr std::size_t seek_footer_size  = 9;
+
+/// @brief Skippable frame at the start of files written by pgn2zst, it marks that all frames
+/// start and end on game boundaries, such that each frame can be parsed on its own.
+static constexpr std::uint32_t game_aligned_magic = 0x184D2A50;
+static constexpr char game_aligned_tag[8]         = {'W', 'D', 'L', 'P', 'G', 'N', 'v', '1'};
+static constexpr std::size_t game_aligned_size    = 8 + sizeof(game_aligned_tag);
+
+struct Frame {
+    std::uint64_t offset;        // offset of the compressed frame in the file
+    std::uint32_t compressed;    // compressed size
+    std::uint32_t decompressed;  // decompressed size
+};
+
+inline std::uint32_t read_le32(const unsigned char *p) {
+    return std::uint32_t(p[0]) | std::uint32_t(p[1]) << 8 | std::uint32_t(p[2]) << 16 |
+           std::uint32_t(p[3]) << 24;
+}
+
+inline void write_le32(std::ostream &out, std::uint32_t v) {
+    const unsigned char bytes[4] = {
+        static_cast<unsigned char>(v), static_cast<unsigned char>(v >> 8),
+        static_cast<unsigned char>(v >> 16), static_cast<unsigned char>(v >> 24)};
+    out.write(reinterpret_cast<const char *>(bytes), sizeof(bytes));
+}
+
+/// @brief Read the seek table of a seekable zstd file, only for files whose frames are aligned to
+/// game boundaries.
+/// @param filename
+/// @return the frames of the file, or an empty vector if the file can not be split
+[[nodiscard]] inline std::vector<Frame> read_game_aligned_frames(const std::string &filename) {
+    std::ifstream file(filename, std::ios::binary);
+
+    unsigned char marker[game_aligned_size];
+    file.read(reinterpret_cast<char *>(marker), sizeof(marker));
+
+    if (!file || read_le32(marker) != game_aligned_magic ||
+        read_le32(marker + 4) != sizeof(game_aligned_tag) ||
+        std::memcmp(marker + 8, game_aligned_tag, sizeof(game_aligned_tag)) != 0) {
+        return {};
+    }
+
+    unsigned char footer[seek_footer_size];
+    file.seekg(-static_cast<std::streamoff>(seek_footer_size), std::ios::end);
+    file.read(reinterpret_cast<char *>(footer), sizeof(footer));
+
+    if (!file || read_le32(footer + 5) != seekable_magic) {
+        return {};
+    }
+
+    const std::uint32_t num_frames = read_le32(footer);
+    const bool has_checksum        = footer[4] & 0x80;
+    const std::size_t entry_size   = has_checksum ? 12 : 8;
+    const std::size_t table_size   = num_frames * entry_size;
+
+    std::vector<unsigned char> table(table_size);
+    file.seekg(-static_cast<std::streamoff>(table_size + seek_footer_size), std::ios::end);
+    file.read(reinterpret_cast<char *>(table.data()), table_size);
+
+    if (!file) {
+        return {};
+    }
+
+    std::vector<Frame> frames;
+    std::uint64_t offset = 0;
+
+    for (std::uint32_t i = 0; i < num_frames; ++i) {
+        const auto entry = table.data() + i * entry_size;
+        frames.push_back({offset, read_le32(entry), read_le32(entry + 4)});
+        offset += frames.back().compressed;
+    }
+
+    return frames;
+}
+
+/// @brief Streambuf decompressing a zstd file, or the range [begin, end) of its frames, or
+/// zstd data already in memory. Skippable frames, like the seek table of the seekable format,
+/// are ignored.
+class zstdstreambuf : public std::streambuf {
+   public:
+    zstdstreambuf(const char *name, std::uint64_t begin, std::uint64_t end)
+        : file(name, std::ios::binary),
+          source(file.rdbuf()),
+          stream(ZSTD_createDStream()),
+          in_buffer(ZSTD_DStreamInSize()),
+          out_buffer(ZSTD_DStreamOutSize()) {
+        ZSTD_initDStream(stream);
+
+        if (end == 0) {
+            remaining = std::numeric_limits<std::uint64_t>::max();
+        } else {
+            remaining = end - begin;
+            file.seekg(begin);
+        }
+
+        input = {in_buffer.data(), 0, 0};
+    }
+
+    explicit zstdstreambuf(std::streambuf *source)
+        : source(source),
+          remaining(std::numeric_limits<std::uint64_t>::max()),
+          stream(ZSTD_createDStream()),
+          in_buffer(ZSTD_DStreamInSize()),
+          out_buffer(ZSTD_DStreamOutSize()) {
+        ZSTD_initDStream(stream);
+
+        input = {in_buffer.data(), 0, 0};
+    }
+
+    ~zstdstreambuf() { ZSTD_freeDStream(stream); }
+
+    zstdstreambuf(const zstdstreambuf &)            = delete;
+    zstdstreambuf &operator=(const zstdstreambuf &) = delete;
+
+    bool is_open() const { return source != file.rdbuf() || file.is_open(); }
+
+   protected:
+    int_type underflow() override {
+        if (gptr() < egptr()) {
+            return traits_type::to_int_type(*gptr());
+        }
+
+        while (true) {
+            // a full output buffer means the decoder may still hold data of the current input
+            if (input.pos == input.size && !output_full) {
+                if (remaining == 0) {
+                    return traits_type::eof();
+                }
+
+                const auto request = std::min<std::uint64_t>(in_buffer.size(), remaining);
+                const auto n       = source->sgetn(in_buffer.data(), request);
+
+                if (n <= 0) {
+                    return traits_type::eof();
+                }
+
+                input.size = n;
+                input.pos  = 0;
+                remaining -= input.size;
+            }
+
+            ZSTD_outBuffer output = {out_buffer.data(), out_buffer.size(), 0};
+            const auto ret        = ZSTD_decompressStream(stream, &output, &input);
+
+            output_full = output.pos == output.size;
+
+            if (ZSTD_isError(ret)) {
+                std::cerr << "Error while decompressing: " << ZSTD_getErrorName(ret) << std::endl;
+                return traits_type::eof();
+            }
+
+            if (output.pos > 0) {
+                setg(out_buffer.data(), out_buffer.data(), out_buffer.data() + output.pos);
+                return traits_type::to_int_type(*gptr());
+            }
+        }
+    }
+
+   private:
+    std::ifstream file;
+    std::streambuf *source;
+    std::uint64_t remaining;
+
+    ZSTD_DStream *stream;
+    std::vector<char> in_buffer;
+    std::vector<char> out_buffer;
+    ZSTD_inBuffer input;
+    bool output_full = false;
+};
+
+class izstream : public std::istream {
+   public:
+    izstream(const char *name, std::uint64_t begin = 0, std::uint64_t end = 0)
+        : std::istream(nullptr), buf(name, begin, end) {
+        rdbuf(&buf);
+
+        if (!buf.is_open()) {
+            setstate(std::ios::failbit);
+        }
+    }
+
+   private:
+    zstdstreambuf buf;
+};
+
+}  // namespace zstd